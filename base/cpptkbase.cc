@@ -9,14 +9,39 @@
 //
 
 #include "cpptkbase.h"
-#include <tcl.h>
-#include <tk.h>
+#include "cpptkinterp.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <list>
 #include <map>
+#include <mutex>
 #include <ostream>
+#include <set>
+#include <unordered_map>
 #include <iostream>
 #include <sstream>
+#include <thread>
+#include <typeinfo>
 #include <boost/scoped_ptr.hpp>
 
+#ifdef __GNUC__
+#include <cxxabi.h>
+#endif
+
+#ifdef __GLIBC__
+#include <execinfo.h>
+#include <pthread.h>
+#include <signal.h>
+#define CPPTK_STACK_SAMPLING
+#endif
+
 using namespace Tk;
 using namespace Tk::details;
 
@@ -61,660 +86,5131 @@ private:
      Tcl_Interp * interp_;
 };
 
-// lazy-initialization of Tcl interpreter
-Tcl_Interp * getInterp()
-{
-     static Interp interp;
-     return interp.get();
-}
-
 // output stream for dumping Tk commands
 // (useful for automated testing)
 std::ostream *dumpstream = &std::cerr;
 
-void do_eval(std::string const &str)
-{
-#ifdef CPPTK_DUMP_COMMANDS
-     *dumpstream << str << '\n';
-#endif // CPPTK_DUMP_COMMANDS
+// when false, the errors are left in the interpreter instead of being
+// thrown (this is used by the try_ functions and applies only to the
+// top-level command, the commands evaluated by the callbacks throw);
+// per thread, like TkError::inTkError(), so that a try_ in one thread
+// does not swallow the errors of another
+thread_local bool throwErrors = true;
 
-#ifndef CPPTK_DONT_EVALUATE
-     int cc = Tcl_Eval(getInterp(), str.c_str());
-     if (cc != TCL_OK)
+// global flag for avoiding multiple-error problem,
+// set while TkError propagates in the current thread
+thread_local bool inTkErrorFlag = false;
+
+// reports the result of the evaluation
+bool evalResult(int cc)
+{
+     if (cc != TCL_OK && throwErrors)
      {
           throw TkError(Tcl_GetStringResult(getInterp()));
      }
-#endif
+     return cc == TCL_OK;
 }
 
-// map for callbacks
-typedef std::map<int, std::shared_ptr<CallbackBase> > CallbacksMap;
-CallbacksMap callbacks;
+// sets the error mode for the scope
+class ErrorMode
+{
+public:
+     explicit ErrorMode(bool throws) : throws_(throwErrors)
+     {
+          throwErrors = throws;
+     }
+     ~ErrorMode() { throwErrors = throws_; }
 
-// callback id
-int callbackId = 0;
+private:
+     bool throws_;
+};
 
-char const *callbackPrefix = "CppTk::callback";
+// runs one pass of the idle handlers - Tcl runs only those that were
+// queued before the call, so the handlers that queue themselves again
+// (and the builders or redraws they schedule) wait for the next pass
+void runIdlePass()
+{
+     Tcl_DoOneEvent(TCL_IDLE_EVENTS | TCL_DONT_WAIT);
+}
 
-typedef std::map<int *,    std::string> IntLinks;
-typedef std::map<double *, std::string> DoubleLinks;
-typedef std::map<std::string *, std::string> StringLinks;
+// timeline tracing
 
-IntLinks intLinks;
-DoubleLinks doubleLinks;
-StringLinks stringLinks;
+std::atomic<bool> traceEnabled(false);
 
-typedef std::map<std::string *, char *> StringLinkBuffers;
-StringLinkBuffers stringLinkBuffers;
+// incremented by each startTrace, the buffers of the previous
+// generations are cleared before they are used again
+std::atomic<unsigned> traceGeneration(0);
+std::atomic<std::size_t> traceCapacity(65536);
 
-int linkId = 0;
+typedef std::chrono::steady_clock TraceClock;
 
-char const *linkVarPrefix = "CppTk::variable";
+long long clockNanoseconds()
+{
+     return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          TraceClock::now().time_since_epoch()).count();
+}
 
-// this function refreshes Tcl variables from C++ variables
-void linkCpptoTcl()
+// the start of the trace, in nanoseconds of the clock (it is read
+// by the other threads while startTrace sets it)
+std::atomic<long long> traceEpoch(0);
+
+// nanoseconds since the start of the trace
+long long traceNow()
 {
-     // synchronize C++ variables with Tcl variables
-     // it is enough to refresh string buffers and update links
-     
-     // refresh string buffers
-     for (StringLinks::iterator it = stringLinks.begin();
-          it != stringLinks.end(); ++it)
-     {
-          std::string *ps = it->first; // pointer to C++ string (original value)
+     return clockNanoseconds() - traceEpoch.load(std::memory_order_relaxed);
+}
 
-          StringLinkBuffers::iterator itb = stringLinkBuffers.find(ps);
-          char *&pb = itb->second; // pointer to Tcl buffer (destination)
-          
-          if (pb != NULL)
-          {
-               Tcl_Free(pb);
-          }
-          pb = Tcl_Alloc(static_cast<unsigned int>(ps->size()) + 1);
-          std::copy(ps->begin(), ps->end(), pb);
-          pb[ps->size()] = '\0';
-          
-          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
-     }
-     
-     // update other (int and double) Tcl links
-     for (IntLinks::iterator it = intLinks.begin();
-          it != intLinks.end(); ++it)
+// the names and details are copied into the record, so that recording
+// a span does not allocate (long texts, like scripts, are cut)
+struct TraceRecord
+{
+     char const *category;
+     char name[48];
+     char detail[128];
+     long long start;
+     long long duration;
+};
+
+// copies the text into the field, the cut texts end with "..."
+template <std::size_t N>
+void copyTraceText(char (&field)[N], char const *text, std::size_t size)
+{
+     if (size < N)
      {
-          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
+          std::memcpy(field, text, size);
+          field[size] = '\0';
      }
-     for (DoubleLinks::iterator it = doubleLinks.begin();
-          it != doubleLinks.end(); ++it)
+     else
      {
-          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
+          std::memcpy(field, text, N - 4);
+          std::memcpy(field + N - 4, "...", 4);
      }
 }
 
-// this function refreshes C++ variables from Tcl variables
-void linkTcltoCpp()
+class TraceBuffer
 {
-     // it is enough to refresh strings from their buffers
-     for (StringLinks::iterator it = stringLinks.begin();
-          it != stringLinks.end(); ++it)
+public:
+     explicit TraceBuffer(int tid)
+          : tid_(tid), generation_(0), capacity_(0), next_(0) {}
+     
+     // gives the record to fill in, or NULL if nothing is recorded
+     TraceRecord * add(char const *category, long long start)
      {
-          std::string *ps = it->first; // pointer to C++ string (destination)
-          
-          StringLinkBuffers::iterator itb = stringLinkBuffers.find(ps);
-          char *pb = itb->second; // pointer to Tcl buffer (original value)
+          unsigned generation = traceGeneration;
+          if (generation != generation_)
+          {
+               // the whole ring is reserved once per trace
+               records_.clear();
+               capacity_ = traceCapacity;
+               records_.reserve(capacity_);
+               next_ = 0;
+               generation_ = generation;
+          }
           
-          if (pb != NULL)
+          TraceRecord *r;
+          if (records_.size() < capacity_)
           {
-               ps->assign(pb);
+               records_.push_back(TraceRecord());
+               r = &records_.back();
+          }
+          else if (records_.empty())
+          {
+               return NULL;
           }
           else
           {
-               ps->clear();
+               // the ring is full, the oldest record is overwritten
+               r = &records_[next_];
+               next_ = (next_ + 1) % records_.size();
           }
+          
+          // the spans started before the trace are cut at its start
+          r->category = category;
+          r->start = start > 0 ? start : 0;
+          r->duration = traceNow() - r->start;
+          return r;
+     }
+     
+     int tid() const { return tid_; }
+     bool current() const { return generation_ == traceGeneration; }
+     
+     // the records are numbered from the oldest one
+     std::size_t size() const { return records_.size(); }
+     TraceRecord const & at(std::size_t i) const
+     {
+          return records_[(next_ + i) % records_.size()];
      }
-}
-
-} // namespace // anonymous
-
 
-// global flag for avoiding multiple-error problem
-bool Tk::TkError::inTkError = false;
+private:
+     int tid_;
+     unsigned generation_;
+     std::size_t capacity_;
+     std::vector<TraceRecord> records_;
+     std::size_t next_;
+};
 
+// all buffers are kept (also after their threads have finished),
+// the mutex is needed only to register them
+std::mutex traceMutex;
+std::vector<TraceBuffer *> traceBuffers;
 
-// generic callback handler
+thread_local TraceBuffer *localTraceBuffer = NULL;
 
-extern "C"
-int callbackHandler(ClientData cd, Tcl_Interp *interp,
-     int objc, Tcl_Obj *CONST objv[])
+TraceRecord * traceRecord(char const *category, char const *name,
+     std::size_t size, long long start)
 {
-     int slot = static_cast<int>(reinterpret_cast<size_t>(cd));
-     
-     CallbacksMap::iterator it = callbacks.find(slot);
-     if (it == callbacks.end())
+     if (localTraceBuffer == NULL)
      {
-          Tcl_SetResult(interp,
-               (char*)"Trying to invoke non-existent callback", TCL_STATIC);
-          return TCL_ERROR;
+          std::lock_guard<std::mutex> lock(traceMutex);
+          localTraceBuffer = new TraceBuffer(
+               static_cast<int>(traceBuffers.size()) + 1);
+          traceBuffers.push_back(localTraceBuffer);
      }
      
-     try
-     {
-          // refresh C++ variables
-          linkTcltoCpp();
-          
-          Params p(objc, reinterpret_cast<void*>(
-               const_cast<Tcl_Obj **>(objv)));
-          it->second->invoke(p);
-          
-          // refresh Tcl variables
-          linkCpptoTcl();
-     }
-     catch (std::exception const &e)
+     TraceRecord *r = localTraceBuffer->add(category, start);
+     if (r != NULL)
      {
-          Tcl_SetResult(interp, const_cast<char*>(e.what()), TCL_VOLATILE);
-          return TCL_ERROR;
+          copyTraceText(r->name, name, size);
+          r->detail[0] = '\0';
      }
-     return TCL_OK;
-}
-
-// generic callback deleter
-
-extern "C"
-void callbackDeleter(ClientData cd)
-{
-     int slot = static_cast<int>(reinterpret_cast<size_t>(cd));
-     callbacks.erase(slot);
+     return r;
 }
 
-std::string Tk::details::addCallback(std::shared_ptr<CallbackBase> cb)
+void traceRecord(char const *category, std::string const &name,
+     long long start)
 {
-     int newSlot = callbackId++;
-     callbacks[newSlot] = cb;
-     
-     std::string newCmd(callbackPrefix);
-     newCmd += std::to_string(newSlot);
-     
-     Tcl_CreateObjCommand(getInterp(), newCmd.c_str(),
-          callbackHandler, reinterpret_cast<ClientData>(
-			static_cast<size_t>(newSlot)),
-          callbackDeleter);
-     
-     return newCmd;
+     traceRecord(category, name.data(), name.size(), start);
 }
 
-std::string Tk::details::addLinkVar(int &i)
+// records the command given as a string, its first word names the span
+void traceCommand(std::string const &cmd, long long start)
 {
-     int newLink = linkId++;
-     std::string newLinkVar(linkVarPrefix);
-     newLinkVar += std::to_string(newLink);
-     
-     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
-          reinterpret_cast<char*>(&i), TCL_LINK_INT);
-     if (cc != TCL_OK)
+     std::string::size_type b = cmd.find_first_not_of(" \t\n");
+     if (b == std::string::npos)
      {
-          throw TkError(Tcl_GetStringResult(getInterp()));
+          b = cmd.size();
+     }
+     std::string::size_type e = cmd.find_first_of(" \t\n", b);
+     if (e == std::string::npos)
+     {
+          e = cmd.size();
      }
      
-     intLinks[&i] = newLinkVar;
-     return newLinkVar;
+     TraceRecord *r = traceRecord("eval", cmd.data() + b, e - b, start);
+     if (r != NULL)
+     {
+          copyTraceText(r->detail, cmd.data(), cmd.size());
+     }
 }
 
-std::string Tk::details::addLinkVar(double &d)
+// records the command given as a list of words - the words are joined
+// in the record itself instead of building the command text
+void traceCommand(std::vector<Tcl_Obj *> const &words, long long start)
 {
-     int newLink = linkId++;
-     std::string newLinkVar(linkVarPrefix);
-     newLinkVar += std::to_string(newLink);
-     
-     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
-          reinterpret_cast<char*>(&d), TCL_LINK_DOUBLE);
-     if (cc != TCL_OK)
+     int size = 0;
+     char const *name = words.empty() ? "" :
+          Tcl_GetStringFromObj(words[0], &size);
+     TraceRecord *r = traceRecord("eval", name, size, start);
+     if (r == NULL)
      {
-          throw TkError(Tcl_GetStringResult(getInterp()));
+          return;
      }
      
-     doubleLinks[&d] = newLinkVar;
-     return newLinkVar;
+     std::size_t const room = sizeof(r->detail);
+     std::size_t used = 0;
+     for (std::size_t i = 0; i != words.size() && used != room; ++i)
+     {
+          if (i != 0)
+          {
+               r->detail[used++] = ' ';
+          }
+          
+          // the words are quoted as list elements when they fit
+          char const *word = Tcl_GetStringFromObj(words[i], &size);
+          int flags = 0;
+          std::size_t quoted = static_cast<std::size_t>(
+               Tcl_ScanCountedElement(word, size, &flags));
+          if (quoted <= room - used)
+          {
+               used += Tcl_ConvertCountedElement(word, size,
+                    r->detail + used,
+                    flags | (i != 0 ? TCL_DONT_QUOTE_HASH : 0));
+          }
+          else
+          {
+               std::size_t n = std::min(static_cast<std::size_t>(size),
+                    room - used);
+               std::memcpy(r->detail + used, word, n);
+               used += n;
+          }
+     }
+     if (used < room)
+     {
+          r->detail[used] = '\0';
+     }
+     else
+     {
+          std::memcpy(r->detail + room - 4, "...", 4);
+     }
 }
 
-std::string Tk::details::addLinkVar(std::string &s)
+void writeJsonString(std::ostream &os, std::string const &s)
 {
-     int newLink = linkId++;
-     std::string newLinkVar(linkVarPrefix);
-     newLinkVar += std::to_string(newLink);
-     
-     std::pair<std::map<std::string *, char *>::iterator, bool> it =
-          stringLinkBuffers.insert(make_pair(&s, static_cast<char*>(NULL)));
-     
-     char *&pb = it.first->second;
-     pb = Tcl_Alloc(static_cast<unsigned int>(s.size()) + 1);
-     copy(s.begin(), s.end(), pb);
-     pb[s.size()] = '\0';
-     
-     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
-          reinterpret_cast<char*>(&it.first->second), TCL_LINK_STRING);
-     if (cc != TCL_OK)
+     os << '"';
+     for (std::string::const_iterator it = s.begin(); it != s.end(); ++it)
      {
-          throw TkError(Tcl_GetStringResult(getInterp()));
+          unsigned char c = static_cast<unsigned char>(*it);
+          if (c == '"' || c == '\\')
+          {
+               os << '\\' << *it;
+          }
+          else if (c < 0x20)
+          {
+               char buf[8];
+               std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+               os << buf;
+          }
+          else
+          {
+               os << *it;
+          }
      }
-     
-     stringLinks[&s] = newLinkVar;
-     return newLinkVar;
+     os << '"';
 }
 
-void Tk::details::deleteLinkVar(int &i)
+// the timestamps are in microseconds
+void writeMicroseconds(std::ostream &os, long long ns)
 {
-     IntLinks::iterator it = intLinks.find(&i);
-     if (it == intLinks.end())
-     {
-          return;
-     }
-     
-     Tcl_UnlinkVar(getInterp(), it->second.c_str());
-     intLinks.erase(it);
+     char buf[32];
+     std::snprintf(buf, sizeof(buf), "%lld.%03lld", ns / 1000, ns % 1000);
+     os << buf;
 }
 
-void Tk::details::deleteLinkVar(double &d)
+// call-site profiler
+
+bool profilerEnabled = false;
+
+typedef std::pair<std::string, int> Site;
+typedef std::map<Site, ProfileEntry> Profile;
+Profile profile;
+
+// the sites of the active scopes and callbacks
+std::vector<Site> sites;
+
+// the time spent in the callbacks by each evaluation in progress
+std::vector<double> callbackTimes;
+
+typedef std::chrono::steady_clock ProfileClock;
+
+double elapsed(ProfileClock::time_point since)
 {
-     DoubleLinks::iterator it = doubleLinks.find(&d);
-     if (it == doubleLinks.end())
-     {
-          return;
-     }
-     
-     Tcl_UnlinkVar(getInterp(), it->second.c_str());
-     doubleLinks.erase(it);
+     return std::chrono::duration<double, std::milli>(
+          ProfileClock::now() - since).count();
 }
 
-void Tk::details::deleteLinkVar(std::string &s)
+// measures the evaluation of the command given as a string
+// or as a list of words
+class EvalTimer
 {
-     StringLinks::iterator it = stringLinks.find(&s);
-     if (it == stringLinks.end())
+public:
+     EvalTimer(std::string const *str, std::vector<Tcl_Obj *> const *words)
+          : active_(profilerEnabled), tracing_(traceEnabled),
+            str_(str), words_(words)
      {
-          return;
-     }
+          if (active_)
+          {
+               callbackTimes.push_back(0.0);
+               start_ = ProfileClock::now();
+          }
+          if (tracing_)
+          {
+               traceStart_ = traceNow();
+          }
+     }
      
-     Tcl_UnlinkVar(getInterp(), it->second.c_str());
-     stringLinks.erase(it);
+     ~EvalTimer()
+     {
+          if (tracing_)
+          {
+               if (str_ != NULL)
+               {
+                    traceCommand(*str_, traceStart_);
+               }
+               else
+               {
+                    traceCommand(*words_, traceStart_);
+               }
+          }
+          
+          if (!active_)
+          {
+               return;
+          }
+          
+          double total = elapsed(start_);
+          double inCallbacks = callbackTimes.back();
+          callbackTimes.pop_back();
+          
+          Site site(sites.empty() ? Site(std::string(), 0) : sites.back());
+          Profile::iterator it = profile.find(site);
+          if (it == profile.end())
+          {
+               it = profile.insert(std::make_pair(site, ProfileEntry())).first;
+               it->second.file = site.first;
+               it->second.line = site.second;
+          }
+          
+          ProfileEntry &e = it->second;
+          ++e.commands;
+          e.inclusive += total;
+          e.exclusive += total - inCallbacks;
+          if (total > e.slowest)
+          {
+               e.slowest = total;
+               e.slowestCommand = text();
+          }
+     }
+
+private:
+     std::string text() const
+     {
+          if (str_ != NULL)
+          {
+               return *str_;
+          }
+          
+          Tcl_Obj *list = Tcl_NewListObj(static_cast<int>(words_->size()),
+               words_->empty() ? NULL : &(*words_)[0]);
+          Tcl_IncrRefCount(list);
+          std::string ret(Tcl_GetString(list));
+          Tcl_DecrRefCount(list);
+          return ret;
+     }
      
-     StringLinkBuffers::iterator itb = stringLinkBuffers.find(&s);
-     char *pb = itb->second;
-     if (pb != NULL)
+     bool active_;
+     bool tracing_;
+     std::string const *str_;
+     std::vector<Tcl_Obj *> const *words_;
+     ProfileClock::time_point start_;
+     long long traceStart_;
+};
+
+// measures the callback and makes it the site of its commands
+class CallbackTimer
+{
+public:
+     // the dispatched callbacks get the arguments after the generation,
+     // the dispatch command and the slot are right before it
+     // (the site is named after the slot only)
+     CallbackTimer(Tcl_Obj *CONST objv[], bool dispatched)
+          : active_(profilerEnabled), tracing_(traceEnabled)
      {
-          Tcl_Free(pb);
+          if (active_ || tracing_)
+          {
+               if (dispatched)
+               {
+                    name_ = Tcl_GetString(objv[-2]);
+                    name_ += ' ';
+                    name_ += Tcl_GetString(objv[-1]);
+               }
+               else
+               {
+                    name_ = Tcl_GetString(objv[0]);
+               }
+          }
+          if (active_)
+          {
+               sites.push_back(Site(name_, 0));
+               start_ = ProfileClock::now();
+          }
+          if (tracing_)
+          {
+               traceStart_ = traceNow();
+          }
      }
      
-     stringLinkBuffers.erase(itb);
-}
+     ~CallbackTimer()
+     {
+          if (active_)
+          {
+               sites.pop_back();
+               if (!callbackTimes.empty())
+               {
+                    callbackTimes.back() += elapsed(start_);
+               }
+          }
+          if (tracing_)
+          {
+               traceRecord("callback", name_, traceStart_);
+          }
+     }
 
-void Tk::details::setResult(bool b)
+private:
+     bool active_;
+     bool tracing_;
+     std::string name_;
+     ProfileClock::time_point start_;
+     long long traceStart_;
+};
+
+// slow-callback watchdog
+
+bool watchdogEnabled = false;
+WatchdogHandler watchdogHandler;
+
+typedef std::chrono::steady_clock WatchClock;
+
+// the budget in nanoseconds (read also by the watchdog thread)
+std::atomic<long long> watchBudget(50000000);
+
+// the outermost watched call (the nested ones are measured,
+// but the stack is sampled only for the outermost one);
+// the start is 0 when there is no such call and the sequence number
+// changes when the call starts and ends
+int watchDepth = 0;
+std::atomic<long long> watchStart(0);
+std::atomic<unsigned> watchSeq(0);
+
+long long watchNow()
 {
-     Tcl_SetObjResult(getInterp(), Tcl_NewBooleanObj(b));
+     return std::chrono::duration_cast<std::chrono::nanoseconds>(
+          WatchClock::now().time_since_epoch()).count();
 }
 
-void Tk::details::setResult(long i)
+std::string typeName(std::type_info const &t)
 {
-     Tcl_SetObjResult(getInterp(), Tcl_NewLongObj(i));
+#ifdef __GNUC__
+     int status;
+     char *name = abi::__cxa_demangle(t.name(), NULL, NULL, &status);
+     if (status == 0 && name != NULL)
+     {
+          std::string ret(name);
+          std::free(name);
+          return ret;
+     }
+#endif
+     return t.name();
 }
 
-void Tk::details::setResult(double d)
+#ifdef CPPTK_STACK_SAMPLING
+
+// the watchdog thread runs until the generation changes
+std::atomic<unsigned> watchdogGeneration(0);
+
+// the application's action for SIGURG, restored by disableWatchdog
+struct sigaction previousUrgAction;
+bool urgActionSaved = false;
+
+// written by the signal handler in the GUI thread;
+// the sequence number is 0 while the frames are being written
+int const maxStackFrames = 64;
+void *stackFrames[maxStackFrames];
+std::atomic<int> stackSize(0);
+std::atomic<unsigned> stackSeq(0);
+
+extern "C"
+void stackSampler(int)
 {
-     Tcl_SetObjResult(getInterp(), Tcl_NewDoubleObj(d));
+     unsigned seq = watchSeq;
+     stackSeq = 0;
+     stackSize = backtrace(stackFrames, maxStackFrames);
+     stackSeq = seq;
 }
 
-void Tk::details::setResult(std::string const &s)
+void watchdogLoop(unsigned generation, pthread_t gui)
 {
-     Tcl_SetObjResult(getInterp(),
-          Tcl_NewStringObj(s.data(), static_cast<int>(s.size())));
+     unsigned sampled = 0;
+     while (watchdogGeneration == generation)
+     {
+          long long period = watchBudget / 4;
+          std::this_thread::sleep_for(std::chrono::nanoseconds(
+               period > 1000000 ? period : 1000000));
+          
+          unsigned seq = watchSeq;
+          long long start = watchStart;
+          if (start != 0 && seq != sampled && seq == watchSeq &&
+               watchNow() - start > watchBudget &&
+               watchdogGeneration == generation)
+          {
+               // the stack is sampled once for each overrun
+               sampled = seq;
+               pthread_kill(gui, SIGURG);
+          }
+     }
 }
 
-int Tk::details::getResultLen()
+// the stack sampled during the call with the given sequence number
+std::vector<std::string> takeStack(unsigned seq)
 {
-     Tcl_Interp *interp = getInterp();
-     
-     Tcl_Obj *list = Tcl_GetObjResult(interp);
-     int len, cc;
+     std::vector<std::string> stack;
+     if (stackSeq != seq)
+     {
+          return stack;
+     }
      
-     cc = Tcl_ListObjLength(interp, list, &len);
-     if (cc != TCL_OK)
+     void *frames[maxStackFrames];
+     int n = stackSize;
+     std::copy(stackFrames, stackFrames + n, frames);
+     if (stackSeq != seq)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          return stack;
      }
      
-     return len;
+     char **symbols = backtrace_symbols(frames, n);
+     if (symbols != NULL)
+     {
+          stack.assign(symbols, symbols + n);
+          std::free(symbols);
+     }
+     return stack;
 }
 
-template <>
-int Tk::details::getResultElem<int>(int indx)
+#else
+
+std::vector<std::string> takeStack(unsigned)
 {
-     Tcl_Interp *interp = getInterp();
+     return std::vector<std::string>();
+}
 
-     Tcl_Obj *list = Tcl_GetObjResult(interp);
-     Tcl_Obj *obj;
+#endif // CPPTK_STACK_SAMPLING
+
+void printSlowCall(SlowCall const &call)
+{
+     std::cerr << "slow " << call.kind << ' ' << call.name;
+     if (!call.type.empty())
+     {
+          std::cerr << " (" << call.type << ')';
+     }
+     std::cerr << ": " << call.duration << " ms\n";
+     for (std::size_t i = 0; i != call.stack.size(); ++i)
+     {
+          std::cerr << "    " << call.stack[i] << '\n';
+     }
+}
+
+// measures the call and reports it if it exceeds the budget
+class Watch
+{
+public:
+     // the detail (if any) is appended to the name
+     Watch(char const *kind, char const *name, char const *detail,
+          std::type_info const *type)
+          : active_(watchdogEnabled), kind_(kind), type_(type)
+     {
+          if (!active_)
+          {
+               return;
+          }
+          
+          name_ = name;
+          if (detail != NULL)
+          {
+               name_ += ' ';
+               name_ += detail;
+          }
+          outer_ = watchDepth++ == 0;
+          start_ = watchNow();
+          if (outer_)
+          {
+               seq_ = ++watchSeq;
+               watchStart = start_;
+          }
+     }
      
-     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
-     if (cc != TCL_OK)
+     ~Watch()
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          if (!active_)
+          {
+               return;
+          }
+          
+          --watchDepth;
+          long long duration = watchNow() - start_;
+          
+          std::vector<std::string> stack;
+          if (outer_)
+          {
+               // the samples taken from now on belong to another call
+               watchStart = 0;
+               ++watchSeq;
+               stack = takeStack(seq_);
+          }
+          
+          if (duration <= watchBudget)
+          {
+               return;
+          }
+          
+          SlowCall call;
+          call.kind = kind_;
+          call.name = name_;
+          if (type_ != NULL)
+          {
+               call.type = typeName(*type_);
+          }
+          call.duration = duration / 1e6;
+          call.stack.swap(stack);
+          
+          try
+          {
+               // the handler can disable the watchdog
+               WatchdogHandler h(watchdogHandler);
+               if (h)
+               {
+                    h(call);
+               }
+               else
+               {
+                    printSlowCall(call);
+               }
+          }
+          catch (std::exception const &e)
+          {
+               backgroundError(e);
+          }
      }
+
+private:
+     bool active_;
+     char const *kind_;
+     std::string name_;
+     std::type_info const *type_;
+     bool outer_;
+     long long start_;
+     unsigned seq_;
+};
+
+// binary command log
+
+// the log consists of the header and the records, each starting with
+// its type; the numbers are written as LEB128
+// S - a new word: length, bytes (the words are numbered from 1)
+// E - a command as a string: time, words (the string split at spaces)
+// O - a command as a list of words: time, words
+// K - a callback invocation: time, words
+// the times are microseconds since the previous record, the words are
+// written as their count and then the number of each word (or 0,
+// the length and the bytes of the word that was not numbered)
+
+char const logHeader[] = "CPPTKLOG\x01";
+std::size_t const logHeaderSize = sizeof(logHeader) - 1;
+
+std::size_t const maxLogWordSize = 64;
+std::size_t const maxLogWords = 65536;
+
+class CommandLog
+{
+public:
+     typedef std::pair<char const *, std::size_t> Word;
      
-     int val;
-     cc = Tcl_GetIntFromObj(interp, obj, &val);
-     if (cc != TCL_OK)
+     explicit CommandLog(std::string const &fileName)
+          : os_(fileName.c_str(), std::ios::binary),
+            start_(std::chrono::steady_clock::now()), last_(0)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          if (!os_)
+          {
+               throw TkError("Cannot open the command log " + fileName);
+          }
+          os_.write(logHeader, logHeaderSize);
      }
      
-     return val;
+     void eval(std::string const &str)
+     {
+          words_.clear();
+          std::string::size_type b = 0;
+          for (;;)
+          {
+               std::string::size_type e = str.find(' ', b);
+               if (e == std::string::npos)
+               {
+                    words_.push_back(Word(str.data() + b, str.size() - b));
+                    break;
+               }
+               words_.push_back(Word(str.data() + b, e - b));
+               b = e + 1;
+          }
+          write('E');
+     }
+     
+     void evalObjv(int objc, Tcl_Obj *CONST objv[], char type = 'O')
+     {
+          words_.clear();
+          for (int i = 0; i != objc; ++i)
+          {
+               int len;
+               char const *s = Tcl_GetStringFromObj(objv[i], &len);
+               words_.push_back(Word(s, static_cast<std::size_t>(len)));
+          }
+          write(type);
+     }
+
+private:
+     void write(char type)
+     {
+          // the new words are defined before the record
+          codes_.clear();
+          for (std::size_t i = 0; i != words_.size(); ++i)
+          {
+               codes_.push_back(code(words_[i]));
+          }
+          
+          long long now = std::chrono::duration_cast<
+               std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - start_).count();
+          
+          os_.put(type);
+          putNumber(static_cast<unsigned long long>(now - last_));
+          putNumber(words_.size());
+          for (std::size_t i = 0; i != words_.size(); ++i)
+          {
+               putNumber(codes_[i]);
+               if (codes_[i] == 0)
+               {
+                    putWord(words_[i]);
+               }
+          }
+          last_ = now;
+     }
+     
+     std::size_t code(Word const &w)
+     {
+          if (w.second > maxLogWordSize)
+          {
+               return 0;
+          }
+          
+          std::string word(w.first, w.second);
+          Codes::iterator it = known_.find(word);
+          if (it != known_.end())
+          {
+               return it->second;
+          }
+          if (known_.size() == maxLogWords)
+          {
+               return 0;
+          }
+          
+          os_.put('S');
+          putWord(w);
+          std::size_t c = known_.size() + 1;
+          known_.insert(std::make_pair(word, c));
+          return c;
+     }
+     
+     void putWord(Word const &w)
+     {
+          putNumber(w.second);
+          os_.write(w.first, static_cast<std::streamsize>(w.second));
+     }
+     
+     void putNumber(unsigned long long n)
+     {
+          while (n >= 0x80)
+          {
+               os_.put(static_cast<char>((n & 0x7f) | 0x80));
+               n >>= 7;
+          }
+          os_.put(static_cast<char>(n));
+     }
+     
+     typedef std::unordered_map<std::string, std::size_t> Codes;
+     
+     std::ofstream os_;
+     std::chrono::steady_clock::time_point start_;
+     long long last_;
+     Codes known_;
+     std::vector<Word> words_;
+     std::vector<std::size_t> codes_;
+};
+
+std::unique_ptr<CommandLog> commandLog;
+
+// UI snapshot
+
+bool snapshotCapturing = false;
+std::string snapshotScript;
+
+char const *snapshotHeader = "# cpptk snapshot 1\n";
+
+// the nesting of the evaluations (the commands evaluated by
+// the callbacks are nested in the commands that invoked them)
+int evalDepth = 0;
+
+class EvalDepth
+{
+public:
+     EvalDepth() : outermost_(evalDepth++ == 0) {}
+     ~EvalDepth() { --evalDepth; }
+     
+     bool outermost() const { return outermost_; }
+
+private:
+     bool outermost_;
+};
+
+bool do_eval(std::string const &str)
+{
+#ifdef CPPTK_DUMP_COMMANDS
+     *dumpstream << str << '\n';
+#endif // CPPTK_DUMP_COMMANDS
+
+     if (commandLog)
+     {
+          commandLog->eval(str);
+     }
+
+#ifndef CPPTK_DONT_EVALUATE
+     int cc;
+     EvalDepth depth;
+     {
+          ErrorMode nested(true);
+          EvalTimer timer(&str, NULL);
+          cc = Tcl_Eval(getInterp(), str.c_str());
+     }
+     if (cc == TCL_OK && snapshotCapturing && depth.outermost())
+     {
+          snapshotScript += str;
+          snapshotScript += '\n';
+     }
+     return evalResult(cc);
+#else
+     return true;
+#endif
 }
 
-template <>
-double Tk::details::getResultElem<double>(int indx)
+// evaluates the command given as a list of ready words
+// the text form is used only for dumping
+bool do_eval_objv(std::vector<Tcl_Obj *> const &words)
 {
-     Tcl_Interp *interp = getInterp();
+#ifdef CPPTK_DUMP_COMMANDS
+     Tcl_Obj *list = Tcl_NewListObj(static_cast<int>(words.size()),
+          words.empty() ? NULL : &words[0]);
+     Tcl_IncrRefCount(list);
+     *dumpstream << Tcl_GetString(list) << '\n';
+     Tcl_DecrRefCount(list);
+#endif // CPPTK_DUMP_COMMANDS
 
-     Tcl_Obj *list = Tcl_GetObjResult(interp);
-     Tcl_Obj *obj;
-     
-     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
-     if (cc != TCL_OK)
+     if (commandLog)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          commandLog->evalObjv(static_cast<int>(words.size()),
+               words.empty() ? NULL : &words[0]);
+     }
+
+#ifndef CPPTK_DONT_EVALUATE
+     int cc;
+     EvalDepth depth;
+     {
+          ErrorMode nested(true);
+          EvalTimer timer(NULL, &words);
+          cc = Tcl_EvalObjv(getInterp(), static_cast<int>(words.size()),
+               const_cast<Tcl_Obj **>(&words[0]), 0);
+     }
+     if (cc == TCL_OK && snapshotCapturing && depth.outermost())
+     {
+          Tcl_Obj *list = Tcl_NewListObj(static_cast<int>(words.size()),
+               &words[0]);
+          Tcl_IncrRefCount(list);
+          snapshotScript += Tcl_GetString(list);
+          snapshotScript += '\n';
+          Tcl_DecrRefCount(list);
+     }
+     return evalResult(cc);
+#else
+     return true;
+#endif
+}
+
+// keeps temporary Tcl objects alive until the end of the scope
+class ObjGuard
+{
+public:
+     ObjGuard() {}
+     ~ObjGuard()
+     {
+          for (std::size_t i = 0; i != objs_.size(); ++i)
+          {
+               Tcl_DecrRefCount(objs_[i]);
+          }
      }
      
-     double val;
-     cc = Tcl_GetDoubleFromObj(interp, obj, &val);
-     if (cc != TCL_OK)
+     void add(Tcl_Obj *obj)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          Tcl_IncrRefCount(obj);
+          objs_.push_back(obj);
+     }
+
+private:
+     ObjGuard(ObjGuard const &);
+     ObjGuard & operator=(ObjGuard const &);
+     
+     std::vector<Tcl_Obj *> objs_;
+};
+
+// splits the part of the command string into separate words
+bool appendWords(std::vector<Tcl_Obj *> &words, ObjGuard &guard,
+     std::string const &str)
+{
+     if (str.find_first_not_of(' ') == std::string::npos)
+     {
+          return true;
+     }
+     
+     Tcl_Obj *list = Tcl_NewStringObj(str.data(), static_cast<int>(str.size()));
+     guard.add(list);
+     
+     int objc;
+     Tcl_Obj **objv;
+     int cc = Tcl_ListObjGetElements(getInterp(), list, &objc, &objv);
+     if (evalResult(cc) == false)
+     {
+          return false;
+     }
+     
+     words.insert(words.end(), objv, objv + objc);
+     return true;
+}
+
+// the text around the object words cannot be split as a list
+// when it has substitutions or more than one command
+bool needsParsing(std::string const &str)
+{
+     return str.find_first_of(";[]$\n") != std::string::npos;
+}
+
+// appends the text to the script, separated from the previous word
+// (the object words are not separated from the text by spaces)
+void appendText(std::string &cmd, std::string const &text, bool afterObj)
+{
+     if (afterObj && text.empty() == false && text[0] != ' ')
+     {
+          cmd += ' ';
+     }
+     cmd += text;
+}
+
+// appends the object as a single word of the script
+void appendQuoted(std::string &cmd, Tcl_Obj *obj)
+{
+     if (cmd.empty() == false && cmd[cmd.size() - 1] != ' ')
+     {
+          cmd += ' ';
+     }
+     
+     Tcl_Obj *word = Tcl_NewListObj(1, &obj);
+     Tcl_IncrRefCount(word);
+     cmd += Tcl_GetString(word);
+     Tcl_DecrRefCount(word);
+}
+
+// shadow state of widget options
+
+bool shadowEnabled = false;
+ShadowStats shadowStats;
+
+// the last values written for each widget (the key is the path)
+// and canvas item (the key is the path and the item id),
+// under the canonical option names
+typedef std::map<std::string, std::string> ShadowOptions;
+struct ShadowEntry
+{
+     // the widget class (and the item type), which gives the option names
+     std::string type;
+     ShadowOptions options;
+};
+typedef std::map<std::string, ShadowEntry> ShadowState;
+ShadowState shadowState;
+
+// the canonical names of the options for each widget class or item type
+// (Tk accepts aliases, like -bg for -background, and abbreviations)
+typedef std::map<std::string, std::string> ShadowNames;
+std::map<std::string, ShadowNames> shadowNames;
+
+// the widgets that have the binding tag of the shadow state
+std::set<std::string> shadowWatched;
+
+#ifndef CPPTK_DONT_EVALUATE
+char const *shadowTag = "CppTk::shadow";
+char const *shadowCommand = "CppTk::unshadow";
+#endif // CPPTK_DONT_EVALUATE
+
+// the values to be remembered after the command succeeds
+struct ShadowUpdate
+{
+     std::string key;
+     std::string type;
+     std::vector<std::pair<std::string, std::string> > values;
+};
+
+// checks whether the key (starting with the path) refers to
+// the widget, its items or its children
+bool belongsTo(std::string const &key, std::string const &path)
+{
+     char next = key.size() > path.size() ? key[path.size()] : ' ';
+     return next == ' ' || next == '.' || path == ".";
+}
+
+// removes the state of the widget, its items and its children
+void forgetShadow(std::string const &path)
+{
+     ShadowState::iterator it = shadowState.lower_bound(path);
+     while (it != shadowState.end() &&
+          it->first.compare(0, path.size(), path) == 0)
+     {
+          if (belongsTo(it->first, path))
+          {
+               shadowState.erase(it++);
+          }
+          else
+          {
+               ++it;
+          }
+     }
+}
+
+// removes the state of all items of the canvas
+void forgetShadowItems(std::string const &path)
+{
+     std::string prefix(path);
+     prefix += ' ';
+     ShadowState::iterator it = shadowState.lower_bound(prefix);
+     while (it != shadowState.end() &&
+          it->first.compare(0, prefix.size(), prefix) == 0)
+     {
+          shadowState.erase(it++);
+     }
+}
+
+// forgets that the widget and its children are watched
+void unwatchShadow(std::string const &path)
+{
+     std::set<std::string>::iterator it = shadowWatched.lower_bound(path);
+     while (it != shadowWatched.end() &&
+          it->compare(0, path.size(), path) == 0)
+     {
+          if (belongsTo(*it, path))
+          {
+               shadowWatched.erase(it++);
+          }
+          else
+          {
+               ++it;
+          }
+     }
+}
+
+bool isItemId(std::string const &s)
+{
+     return !s.empty() &&
+          s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+// the commands that create widgets (a new widget starts with
+// the default values, even if the path was used before)
+bool isWidgetCommand(std::string const &name)
+{
+     static char const *names[] = { "button", "canvas", "checkbutton",
+          "entry", "frame", "label", "labelframe", "listbox", "menu",
+          "menubutton", "message", "panedwindow", "radiobutton", "scale",
+          "scrollbar", "spinbox", "text", "toplevel" };
+     static std::set<std::string> const commands(names,
+          names + sizeof(names) / sizeof(names[0]));
+     
+     return commands.count(name) != 0 || name.compare(0, 5, "ttk::") == 0;
+}
+
+// evaluates the query needed by the library itself
+// (without dumping, logging or timing it)
+bool queryWords(std::string const *words, int n)
+{
+     ObjGuard guard;
+     std::vector<Tcl_Obj *> objv;
+     for (int i = 0; i != n; ++i)
+     {
+          Tcl_Obj *o = Tcl_NewStringObj(words[i].data(),
+               static_cast<int>(words[i].size()));
+          guard.add(o);
+          objv.push_back(o);
+     }
+     return Tcl_EvalObjv(getInterp(), n, &objv[0], 0) == TCL_OK;
+}
+
+// finds the widget class (and the item type) for the key;
+// returns the empty string if the widget or item does not exist
+std::string shadowType(std::string const &key)
+{
+#ifndef CPPTK_DONT_EVALUATE
+     std::string::size_type sp = key.find(' ');
+     std::string path(key, 0, sp);
+     std::string winfo[] = { "winfo", "class", path };
+     if (queryWords(winfo, 3) == false)
+     {
+          return std::string();
+     }
+     std::string type(Tcl_GetStringResult(getInterp()));
+     
+     if (sp != std::string::npos)
+     {
+          std::string itemType[] = { path, "type", key.substr(sp + 1) };
+          if (queryWords(itemType, 3) == false ||
+               *Tcl_GetStringResult(getInterp()) == '\0')
+          {
+               return std::string();
+          }
+          type += ' ';
+          type += Tcl_GetStringResult(getInterp());
+     }
+     return type;
+#else
+     (void)key;
+     return std::string();
+#endif // CPPTK_DONT_EVALUATE
+}
+
+// resolves the alias or abbreviation of the option in the same way
+// as Tk does; the name is left as it is if it cannot be resolved
+// (then the write itself fails and is not remembered)
+std::string canonicalName(std::string const &key, std::string const &type,
+     std::string const &name)
+{
+     if (type.empty())
+     {
+          return name;
+     }
+     
+     ShadowNames &names = shadowNames[type];
+     ShadowNames::const_iterator it = names.find(name);
+     if (it != names.end())
+     {
+          return it->second;
+     }
+     
+     std::string::size_type sp = key.find(' ');
+     bool ok;
+     if (sp == std::string::npos)
+     {
+          std::string query[] = { key, "configure", name };
+          ok = queryWords(query, 3);
+     }
+     else
+     {
+          std::string query[] = { key.substr(0, sp), "itemconfigure",
+               key.substr(sp + 1), name };
+          ok = queryWords(query, 4);
+     }
+     
+     // the alias is described by its target,
+     // other options by their full description
+     int objc;
+     Tcl_Obj **objv;
+     if (ok == false || Tcl_ListObjGetElements(NULL,
+               Tcl_GetObjResult(getInterp()), &objc, &objv) != TCL_OK ||
+          objc < 2)
+     {
+          return name;
+     }
+     std::string canonical(Tcl_GetString(objc == 2 ? objv[1] : objv[0]));
+     names[name] = canonical;
+     return canonical;
+}
+
+// called from the binding tag when the widget is destroyed (with its path)
+extern "C"
+int unshadowHandler(ClientData, Tcl_Interp *interp, int objc,
+     Tcl_Obj *CONST objv[])
+{
+     if (objc == 2)
+     {
+          std::string path(Tcl_GetString(objv[1]));
+          forgetShadow(path);
+          unwatchShadow(path);
+     }
+     Tcl_ResetResult(interp);
+     return TCL_OK;
+}
+
+// puts the binding tag in front of the widget's tags, so that the state
+// is forgotten when the widget is destroyed (the widget command is not
+// traced, since that would slow down each command sent to the widget)
+bool watchShadow(std::string const &path)
+{
+#ifndef CPPTK_DONT_EVALUATE
+     if (shadowWatched.count(path) != 0)
+     {
+          return true;
+     }
+     
+     Tcl_Interp *interp = getInterp();
+     
+     static bool registered = false;
+     if (!registered)
+     {
+          std::string script("bind ");
+          script += shadowTag;
+          script += " <Destroy> {";
+          script += shadowCommand;
+          script += " %W}";
+          if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
+          {
+               return false;
+          }
+          
+          Tcl_CreateObjCommand(interp, shadowCommand, unshadowHandler, 0, 0);
+          registered = true;
+     }
+     
+     // the tag may be already there,
+     // if the widget was forgotten by clearShadowState
+     std::string script("bindtags ");
+     script += path;
+     script += " [linsert [lsearch -all -inline -not -exact [bindtags ";
+     script += path;
+     script += "] ";
+     script += shadowTag;
+     script += "] 0 ";
+     script += shadowTag;
+     script += ']';
+     int cc = Tcl_Eval(interp, script.c_str());
+     Tcl_ResetResult(interp);
+     if (cc != TCL_OK)
+     {
+          return false;
+     }
+     shadowWatched.insert(path);
+#else
+     (void)path;
+#endif // CPPTK_DONT_EVALUATE
+     return true;
+}
+
+// quick check whether the command string can be a configure, destroy
+// or widget creation command (or other command that changes the state),
+// without substitutions
+bool shadowCandidate(std::string const &cmd)
+{
+     std::string::size_type sp = cmd.find(' ');
+     if (sp == std::string::npos)
+     {
+          return false;
+     }
+     std::string name(cmd, 0, sp);
+     if (name != "destroy" && name != "bindtags" && name != "tk_setPalette" &&
+          !isWidgetCommand(name))
+     {
+          std::string::size_type w = cmd.find_first_not_of(' ', sp);
+          if (w == std::string::npos ||
+               (cmd.compare(w, 10, "configure ") != 0 &&
+                    cmd.compare(w, 14, "itemconfigure ") != 0))
+          {
+               return false;
+          }
+     }
+
+     for (std::string::size_type i = 0; i < cmd.size(); ++i)
+     {
+          char c = cmd[i];
+          if (c == '\\')
+          {
+               ++i;
+          }
+          else if (c == '$' || c == '[' || c == ';' || c == '\n')
+          {
+               return false;
+          }
+     }
+     return true;
+}
+
+// removes the option values that are already set;
+// returns false if nothing is left to be done
+bool shadowFilter(std::vector<Tcl_Obj *> &words, ShadowUpdate &update)
+{
+     std::size_t n = words.size();
+     if (n < 2)
+     {
+          return true;
+     }
+
+     std::string path(Tcl_GetString(words[0]));
+     if (path == "destroy")
+     {
+          for (std::size_t i = 1; i != n; ++i)
+          {
+               forgetShadow(Tcl_GetString(words[i]));
+          }
+          return true;
+     }
+     if (path == "tk_setPalette")
+     {
+          // the colors of all widgets are changed
+          shadowState.clear();
+          return true;
+     }
+     if (path == "bindtags")
+     {
+          // the binding tag of the shadow state can be lost
+          if (n > 2)
+          {
+               forgetShadow(Tcl_GetString(words[1]));
+               shadowWatched.erase(Tcl_GetString(words[1]));
+          }
+          return true;
+     }
+     if (isWidgetCommand(path))
+     {
+          // the widget is new, even if the old one was destroyed
+          // without the library knowing about it
+          std::string created(Tcl_GetString(words[1]));
+          forgetShadow(created);
+          unwatchShadow(created);
+          return true;
+     }
+
+     std::string sub(Tcl_GetString(words[1]));
+     std::size_t first;
+     if (sub == "configure" && n >= 4 && n % 2 == 0)
+     {
+          update.key = path;
+          first = 2;
+     }
+     else if (sub == "itemconfigure" && n >= 5 && n % 2 == 1)
+     {
+          std::string item(Tcl_GetString(words[2]));
+          if (!isItemId(item))
+          {
+               // the tag can refer to any of the items
+               forgetShadowItems(path);
+               return true;
+          }
+          update.key = path;
+          update.key += ' ';
+          update.key += item;
+          first = 3;
+     }
+     else
+     {
+          return true;
+     }
+
+     ShadowState::const_iterator sit = shadowState.find(update.key);
+     update.type = sit != shadowState.end() ?
+          sit->second.type : shadowType(update.key);
+     
+     std::vector<Tcl_Obj *> kept(words.begin(), words.begin() + first);
+     for (std::size_t i = first; i != n; i += 2)
+     {
+          std::string name(canonicalName(update.key, update.type,
+               Tcl_GetString(words[i])));
+          std::string value(Tcl_GetString(words[i + 1]));
+          ++shadowStats.writes;
+
+          if (sit != shadowState.end())
+          {
+               ShadowOptions::const_iterator oit =
+                    sit->second.options.find(name);
+               if (oit != sit->second.options.end() && oit->second == value)
+               {
+                    ++shadowStats.suppressed;
+                    continue;
+               }
+          }
+
+          update.values.push_back(std::make_pair(name, value));
+          kept.push_back(words[i]);
+          kept.push_back(words[i + 1]);
+     }
+
+     if (kept.size() == first)
+     {
+          ++shadowStats.skipped;
+          return false;
+     }
+
+     words.swap(kept);
+     return true;
+}
+
+void shadowCommit(ShadowUpdate const &update)
+{
+     if (update.values.empty())
+     {
+          return;
+     }
+     
+     // the values that could become stale unnoticed are not remembered
+     if (watchShadow(update.key.substr(0, update.key.find(' '))) == false)
+     {
+          return;
+     }
+
+     ShadowEntry &entry = shadowState[update.key];
+     entry.type = update.type;
+     for (std::size_t i = 0; i != update.values.size(); ++i)
+     {
+          entry.options[update.values[i].first] = update.values[i].second;
+     }
+}
+
+// evaluates the command word by word, skipping the values
+// that are already set
+bool do_eval_shadowed(std::vector<Tcl_Obj *> &words)
+{
+     ShadowUpdate update;
+     if (shadowFilter(words, update) == false)
+     {
+          Tcl_ResetResult(getInterp());
+          return true;
+     }
+
+     if (do_eval_objv(words) == false)
+     {
+          return false;
+     }
+     shadowCommit(update);
+     return true;
+}
+
+// the same for the command string
+bool do_eval_shadowed(std::string const &cmd)
+{
+     Tcl_Obj *list = Tcl_NewStringObj(cmd.data(), static_cast<int>(cmd.size()));
+     ObjGuard guard;
+     guard.add(list);
+
+     int objc;
+     Tcl_Obj **objv;
+     if (Tcl_ListObjGetElements(NULL, list, &objc, &objv) != TCL_OK)
+     {
+          return do_eval(cmd);
+     }
+
+     std::vector<Tcl_Obj *> words(objv, objv + objc);
+     ShadowUpdate update;
+     if (shadowFilter(words, update) == false)
+     {
+          Tcl_ResetResult(getInterp());
+          return true;
+     }
+
+     // unchanged commands are evaluated as they are
+     bool ok = static_cast<int>(words.size()) == objc ?
+          do_eval(cmd) : do_eval_objv(words);
+     if (ok == false)
+     {
+          return false;
+     }
+     shadowCommit(update);
+     return true;
+}
+
+// cache of query results
+
+bool cacheEnabled = false;
+QueryCacheStats cacheStats;
+
+// the commands are not evaluated in the test build,
+// so there are no results to be cached
+#ifdef CPPTK_DONT_EVALUATE
+bool const cacheEvaluated = false;
+#else
+bool const cacheEvaluated = true;
+#endif
+
+// the cached results of queries about the widget
+struct CachedWidget
+{
+     CachedWidget() : mapped(false) {}
+     
+     // the geometry is cached only after the window was mapped,
+     // because Tk does not report the changes before that
+     bool mapped;
+     
+     std::map<std::string, ObjRef> winfo;     // the key is the attribute
+     std::map<std::string, ObjRef> options;   // the key is the option
+};
+typedef std::map<std::string, CachedWidget> QueryCache;
+QueryCache queryCache;
+
+char const *cacheTag = "CppTk::cache";
+char const *cacheCommand = "CppTk::invalidate";
+
+// the widgets that have the binding tag of the cache
+// (they keep it when their entries are invalidated)
+std::set<std::string> cacheWatched;
+bool cacheRegistered = false;
+
+// the query that can be cached
+struct Query
+{
+     std::string path;
+     std::string key;
+     bool winfo;
+};
+
+// splits the command at spaces (without any quoting rules),
+// the words after the given number are ignored
+void splitAtSpaces(std::string const &cmd, std::vector<std::string> &words,
+     std::size_t max)
+{
+     std::string::size_type pos = cmd.find_first_not_of(' ');
+     while (pos != std::string::npos && words.size() != max)
+     {
+          std::string::size_type end = cmd.find(' ', pos);
+          words.push_back(cmd.substr(pos, end - pos));
+          pos = cmd.find_first_not_of(' ', end);
+     }
+}
+
+// recognizes the winfo and cget queries
+bool isQuery(std::vector<std::string> const &words, Query &q)
+{
+     if (words.size() != 3)
+     {
+          return false;
+     }
+     
+     if (words[0] == "winfo")
+     {
+          // only those attributes that are reported by Configure events
+          // (and the class, which never changes)
+          std::string const &attr = words[1];
+          if (attr != "width" && attr != "height" &&
+               attr != "x" && attr != "y" && attr != "class")
+          {
+               return false;
+          }
+          q.path = words[2];
+          q.key = attr;
+          q.winfo = true;
+     }
+     else if (words[1] == "cget")
+     {
+          q.path = words[0];
+          q.key = words[2];
+          q.winfo = false;
+     }
+     else
+     {
+          return false;
+     }
+     
+     return q.path[0] == '.';
+}
+
+// removes the cached results of the widget and its children
+void forgetCached(std::string const &path)
+{
+     QueryCache::iterator it = queryCache.lower_bound(path);
+     while (it != queryCache.end() &&
+          it->first.compare(0, path.size(), path) == 0)
+     {
+          if (belongsTo(it->first, path))
+          {
+               queryCache.erase(it++);
+          }
+          else
+          {
+               ++it;
+          }
+     }
+}
+
+// forgets the results that can be changed by the command
+void cacheWrite(std::vector<std::string> const &words)
+{
+     if (words.size() < 2)
+     {
+          return;
+     }
+     
+     if (words[0] == "destroy")
+     {
+          for (std::size_t i = 1; i != words.size(); ++i)
+          {
+               forgetCached(words[i]);
+          }
+     }
+     else if (words[0] == "bindtags")
+     {
+          // the binding tag of the cache can be lost
+          if (words.size() > 2)
+          {
+               queryCache.erase(words[1]);
+          }
+     }
+     else if (words[0] == "tk_setPalette")
+     {
+          for (QueryCache::iterator it = queryCache.begin();
+               it != queryCache.end(); ++it)
+          {
+               it->second.options.clear();
+          }
+     }
+     else if (words[1] == "configure")
+     {
+          QueryCache::iterator it = queryCache.find(words[0]);
+          if (it != queryCache.end())
+          {
+               it->second.options.clear();
+          }
+     }
+}
+
+// called from the binding tag of the cache,
+// with the additional argument when the widget is destroyed
+extern "C"
+int invalidateHandler(ClientData, Tcl_Interp *, int objc,
+     Tcl_Obj *CONST objv[])
+{
+     if (objc < 2)
+     {
+          return TCL_OK;
+     }
+     
+     if (objc > 2)
+     {
+          cacheWatched.erase(Tcl_GetString(objv[1]));
+     }
+     
+     QueryCache::iterator it = queryCache.find(Tcl_GetString(objv[1]));
+     if (it == queryCache.end())
+     {
+          return TCL_OK;
+     }
+     
+     if (objc > 2)
+     {
+          queryCache.erase(it);
+     }
+     else
+     {
+          it->second.mapped = true;
+          it->second.winfo.clear();
+     }
+     return TCL_OK;
+}
+
+// puts the binding tag of the cache in front of the widget's tags
+bool watchWidget(std::string const &path, CachedWidget &cw)
+{
+     Tcl_Interp *interp = getInterp();
+     
+     if (!cacheRegistered)
+     {
+          std::string script("bind ");
+          script += cacheTag;
+          script += " <Configure> {";
+          script += cacheCommand;
+          script += " %W}; bind ";
+          script += cacheTag;
+          script += " <Destroy> {";
+          script += cacheCommand;
+          script += " %W destroyed}";
+          if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
+          {
+               return false;
+          }
+          
+          Tcl_CreateObjCommand(interp, cacheCommand, invalidateHandler, 0, 0);
+          cacheRegistered = true;
+     }
+     
+     // the widget is tagged only once, even if its entry was invalidated
+     std::string script;
+     if (cacheWatched.count(path) == 0)
+     {
+          script += "bindtags ";
+          script += path;
+          script += " [linsert [bindtags ";
+          script += path;
+          script += "] 0 ";
+          script += cacheTag;
+          script += "]; ";
+     }
+     script += "winfo ismapped ";
+     script += path;
+     
+     int mapped;
+     if (Tcl_Eval(interp, script.c_str()) != TCL_OK ||
+          Tcl_GetIntFromObj(NULL, Tcl_GetObjResult(interp), &mapped) != TCL_OK)
+     {
+          return false;
+     }
+     
+     cacheWatched.insert(path);
+     cw.mapped = mapped != 0;
+     return true;
+}
+
+// takes the binding tag of the cache out of the widgets
+// and deletes its bindings
+void unwatchWidgets()
+{
+     if (!cacheRegistered)
+     {
+          return;
+     }
+     
+     Tcl_Interp *interp = getInterp();
+     for (std::set<std::string>::const_iterator it = cacheWatched.begin();
+          it != cacheWatched.end(); ++it)
+     {
+          std::string script("if {[winfo exists ");
+          script += *it;
+          script += "]} {bindtags ";
+          script += *it;
+          script += " [lsearch -all -inline -not -exact [bindtags ";
+          script += *it;
+          script += "] ";
+          script += cacheTag;
+          script += "]}";
+          Tcl_Eval(interp, script.c_str());
+     }
+     cacheWatched.clear();
+     
+     std::string script("foreach s [bind ");
+     script += cacheTag;
+     script += "] {bind ";
+     script += cacheTag;
+     script += " $s {}}";
+     Tcl_Eval(interp, script.c_str());
+     Tcl_ResetResult(interp);
+     Tcl_DeleteCommand(interp, cacheCommand);
+     cacheRegistered = false;
+}
+
+// finds the result of the query and makes it the interpreter's result
+bool cacheLookup(Query const &q)
+{
+     QueryCache::iterator it = queryCache.find(q.path);
+     if (it != queryCache.end())
+     {
+          std::map<std::string, ObjRef> &values =
+               q.winfo ? it->second.winfo : it->second.options;
+          std::map<std::string, ObjRef>::iterator vit = values.find(q.key);
+          if (vit != values.end())
+          {
+               ++cacheStats.hits;
+               Tcl_SetObjResult(getInterp(),
+                    static_cast<Tcl_Obj *>(vit->second.get()));
+               return true;
+          }
+     }
+     
+     ++cacheStats.misses;
+     return false;
+}
+
+// remembers the result of the query that was just evaluated
+void cacheStore(Query const &q)
+{
+     Tcl_Interp *interp = getInterp();
+     ObjRef result(Tcl_GetObjResult(interp));
+     
+     QueryCache::iterator it = queryCache.find(q.path);
+     if (it == queryCache.end())
+     {
+          // the widget is watched from now on
+          it = queryCache.insert(std::make_pair(q.path, CachedWidget())).first;
+          bool watched = watchWidget(q.path, it->second);
+          Tcl_SetObjResult(interp, static_cast<Tcl_Obj *>(result.get()));
+          if (!watched)
+          {
+               queryCache.erase(it);
+               return;
+          }
+     }
+     
+     if (q.winfo)
+     {
+          if (it->second.mapped)
+          {
+               it->second.winfo[q.key] = result;
+          }
+     }
+     else
+     {
+          it->second.options[q.key] = result;
+     }
+}
+
+// serves the query from the cache, or evaluates it and caches the result;
+// returns false if the command is not a query and has to be evaluated
+// (otherwise ok tells whether the query succeeded)
+bool evalCached(std::string const &cmd, bool &ok)
+{
+     std::vector<std::string> words;
+     splitAtSpaces(cmd, words, cmd.compare(0, 8, "destroy ") == 0 ?
+          std::string::npos : 4);
+     
+     Query q;
+     if (isQuery(words, q) == false ||
+          cmd.find_first_of("\"{}\\$[];\n\t") != std::string::npos)
+     {
+          cacheWrite(words);
+          return false;
+     }
+     
+     ok = true;
+     if (cacheLookup(q) == false)
+     {
+          ok = do_eval(cmd);
+          if (ok)
+          {
+               cacheStore(q);
+          }
+     }
+     return true;
+}
+
+// the same for the command given as a list of words
+bool evalCached(std::vector<Tcl_Obj *> const &objv, bool &ok)
+{
+     std::vector<std::string> words;
+     std::size_t n = objv.size();
+     if (n > 3 && std::string(Tcl_GetString(objv[0])) != "destroy")
+     {
+          n = 3;
+     }
+     for (std::size_t i = 0; i != n; ++i)
+     {
+          words.push_back(Tcl_GetString(objv[i]));
+     }
+     
+     Query q;
+     if (objv.size() != 3 || isQuery(words, q) == false)
+     {
+          cacheWrite(words);
+          return false;
+     }
+     
+     ok = true;
+     if (cacheLookup(q) == false)
+     {
+          ok = do_eval_objv(objv);
+          if (ok)
+          {
+               cacheStore(q);
+          }
+     }
+     return true;
+}
+
+// map for callbacks
+typedef std::map<int, std::shared_ptr<CallbackBase> > CallbacksMap;
+CallbacksMap callbacks;
+
+// callback id
+int callbackId = 0;
+
+char const *callbackPrefix = "CppTk::callback";
+char const *namedCallbackPrefix = "CppTk::named::";
+int namedCallbackId = 0;
+
+// dense table of callbacks invoked through the single dispatch command,
+// the slots are reused
+bool dispatchEnabled = false;
+std::vector<std::shared_ptr<CallbackBase> > dispatchTable;
+std::vector<int> freeSlots;
+
+// the generation of each slot is a part of the callback name and changes
+// when the slot is released, so that the stale names (left in scripts
+// after the callback was deleted) do not invoke the next callback
+std::vector<unsigned> dispatchGenerations;
+
+char const *dispatchCommand = "CppTk::dispatch";
+
+// the dispatched callbacks are identified by negative keys
+// in the sets below
+int dispatchKey(int slot) { return -slot - 1; }
+
+// callbacks that will be owned by the widget they are given to
+// (only the first command that mentions the callback can adopt it)
+std::set<int> orphans;
+
+// callbacks owned by widgets (the key is the path), together with
+// the option or binding they are set for (empty if not known);
+// they are deleted together with the widget command, or when another
+// callback is set for the same option or binding
+struct OwnedCallback
+{
+     std::string context;
+     int key;
+     unsigned generation;     // of the dispatch slot
+};
+typedef std::vector<OwnedCallback> OwnedCallbacks;
+typedef std::map<std::string, OwnedCallbacks> OwnersMap;
+OwnersMap owners;
+
+// map for file descriptor handlers
+typedef std::map<int, std::shared_ptr<FdHandler> > FdHandlersMap;
+FdHandlersMap fdHandlers;
+
+typedef std::map<int *,    std::string> IntLinks;
+typedef std::map<double *, std::string> DoubleLinks;
+typedef std::map<std::string *, std::string> StringLinks;
+
+IntLinks intLinks;
+DoubleLinks doubleLinks;
+StringLinks stringLinks;
+
+typedef std::map<std::string *, char *> StringLinkBuffers;
+StringLinkBuffers stringLinkBuffers;
+
+int linkId = 0;
+
+char const *linkVarPrefix = "CppTk::variable";
+
+} // namespace // anonymous
+
+// this function refreshes Tcl variables from C++ variables
+void Tk::details::linkCpptoTcl()
+{
+     TraceSpan span("linkCpptoTcl", "link");
+     
+     // synchronize C++ variables with Tcl variables
+     // it is enough to refresh string buffers and update links
+     
+     // refresh string buffers
+     for (StringLinks::iterator it = stringLinks.begin();
+          it != stringLinks.end(); ++it)
+     {
+          std::string *ps = it->first; // pointer to C++ string (original value)
+
+          StringLinkBuffers::iterator itb = stringLinkBuffers.find(ps);
+          char *&pb = itb->second; // pointer to Tcl buffer (destination)
+          
+          if (pb != NULL)
+          {
+               Tcl_Free(pb);
+          }
+          pb = Tcl_Alloc(static_cast<unsigned int>(ps->size()) + 1);
+          std::copy(ps->begin(), ps->end(), pb);
+          pb[ps->size()] = '\0';
+          
+          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
+     }
+     
+     // update other (int and double) Tcl links
+     for (IntLinks::iterator it = intLinks.begin();
+          it != intLinks.end(); ++it)
+     {
+          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
+     }
+     for (DoubleLinks::iterator it = doubleLinks.begin();
+          it != doubleLinks.end(); ++it)
+     {
+          Tcl_UpdateLinkedVar(getInterp(), it->second.c_str());
+     }
+}
+
+// this function refreshes C++ variables from Tcl variables
+void Tk::details::linkTcltoCpp()
+{
+     TraceSpan span("linkTcltoCpp", "link");
+     
+     // it is enough to refresh strings from their buffers
+     for (StringLinks::iterator it = stringLinks.begin();
+          it != stringLinks.end(); ++it)
+     {
+          std::string *ps = it->first; // pointer to C++ string (destination)
+          
+          StringLinkBuffers::iterator itb = stringLinkBuffers.find(ps);
+          char *pb = itb->second; // pointer to Tcl buffer (original value)
+          
+          if (pb != NULL)
+          {
+               ps->assign(pb);
+          }
+          else
+          {
+               ps->clear();
+          }
+     }
+}
+
+
+// lazy-initialization of Tcl interpreter
+Tcl_Interp * Tk::details::getInterp()
+{
+     static Interp interp;
+     return interp.get();
+}
+
+Tk::TkError::TkError(std::string const &msg)
+     : std::runtime_error(msg)
+{
+     inTkErrorFlag = true;
+}
+
+Tk::TkError::~TkError() throw()
+{
+     inTkErrorFlag = false;
+}
+
+bool Tk::TkError::inTkError()
+{
+     return inTkErrorFlag;
+}
+
+
+namespace { // anonymous
+
+// the callback can be deleted while it runs
+// (for example, when it destroys its own widget),
+// so it is passed by value
+int invokeCallback(std::shared_ptr<CallbackBase> cb, Tcl_Interp *interp,
+     int objc, Tcl_Obj *CONST objv[], bool dispatched)
+{
+     // the dispatched callbacks are invoked by the dispatch command,
+     // the slot and the generation, the callback gets the arguments
+     // after the generation
+     Tcl_Obj *CONST *command = dispatched ? objv - 2 : objv;
+     
+     if (commandLog)
+     {
+          commandLog->evalObjv(dispatched ? objc + 2 : objc, command, 'K');
+     }
+     
+     CallbackTimer timer(objv, dispatched);
+     Watch watch("callback", Tcl_GetString(command[0]),
+          dispatched ? Tcl_GetString(objv[-1]) : NULL, &typeid(*cb));
+     try
+     {
+          // refresh C++ variables
+          linkTcltoCpp();
+          
+          Params p(objc, reinterpret_cast<void*>(
+               const_cast<Tcl_Obj **>(objv)));
+          cb->invoke(p);
+          
+          // refresh Tcl variables
+          linkCpptoTcl();
+     }
+     catch (std::exception const &e)
+     {
+          Tcl_SetResult(interp, const_cast<char*>(e.what()), TCL_VOLATILE);
+          return TCL_ERROR;
+     }
+     return TCL_OK;
+}
+
+bool validSlot(int slot, unsigned generation)
+{
+     return slot >= 0 && slot < static_cast<int>(dispatchTable.size()) &&
+          dispatchTable[slot] && dispatchGenerations[slot] == generation;
+}
+
+// the slot is released only if it still has the given generation
+void releaseSlot(int slot, unsigned generation)
+{
+     if (!validSlot(slot, generation))
+     {
+          return;
+     }
+     
+     dispatchTable[slot].reset();
+     ++dispatchGenerations[slot];
+     freeSlots.push_back(slot);
+     orphans.erase(dispatchKey(slot));
+}
+
+// reads the slot and the generation from the words after the dispatch
+// command (in the callback name)
+void parseDispatch(char const *words, int &slot, unsigned &generation)
+{
+     char *end;
+     slot = static_cast<int>(std::strtol(words, &end, 10));
+     generation = static_cast<unsigned>(std::strtoul(end, NULL, 10));
+}
+
+// deletes the owned callback
+void releaseOwned(Tcl_Interp *interp, OwnedCallback const &owned)
+{
+     int key = owned.key;
+     if (key < 0)
+     {
+          releaseSlot(-key - 1, owned.generation);
+          return;
+     }
+     
+     std::string name(callbackPrefix);
+     name += std::to_string(key);
+     Tcl_DeleteCommand(interp, name.c_str());
+}
+
+} // namespace anonymous
+
+// generic callback handler
+
+extern "C"
+int callbackHandler(ClientData cd, Tcl_Interp *interp,
+     int objc, Tcl_Obj *CONST objv[])
+{
+     int slot = static_cast<int>(reinterpret_cast<size_t>(cd));
+     
+     CallbacksMap::iterator it = callbacks.find(slot);
+     if (it == callbacks.end())
+     {
+          Tcl_SetResult(interp,
+               (char*)"Trying to invoke non-existent callback", TCL_STATIC);
+          return TCL_ERROR;
+     }
+     
+     return invokeCallback(it->second, interp, objc, objv, false);
+}
+
+// the dispatch command - the first arguments are the slot and its
+// generation, the callback gets the remaining ones
+
+extern "C"
+int dispatchHandler(ClientData, Tcl_Interp *interp,
+     int objc, Tcl_Obj *CONST objv[])
+{
+     if (objc < 3)
+     {
+          Tcl_WrongNumArgs(interp, 1, objv, "slot generation ?arg ...?");
+          return TCL_ERROR;
+     }
+     
+     int slot;
+     int generation;
+     if (Tcl_GetIntFromObj(interp, objv[1], &slot) != TCL_OK ||
+          Tcl_GetIntFromObj(interp, objv[2], &generation) != TCL_OK)
+     {
+          return TCL_ERROR;
+     }
+     
+     if (!validSlot(slot, static_cast<unsigned>(generation)))
+     {
+          Tcl_SetResult(interp,
+               (char*)"Trying to invoke non-existent callback", TCL_STATIC);
+          return TCL_ERROR;
+     }
+     
+     return invokeCallback(dispatchTable[slot], interp, objc - 2, objv + 2,
+          true);
+}
+
+// generic callback deleter
+
+extern "C"
+void callbackDeleter(ClientData cd)
+{
+     int slot = static_cast<int>(reinterpret_cast<size_t>(cd));
+     callbacks.erase(slot);
+     
+     // the negative keys of orphans belong to the dispatch slots
+     // (the named callbacks are never owned)
+     if (slot >= 0)
+     {
+          orphans.erase(slot);
+     }
+}
+
+// deletes the callbacks owned by the widget, when its command is deleted
+
+extern "C"
+void ownerDeleted(ClientData cd, Tcl_Interp *interp,
+     CONST char *, CONST char *, int flags)
+{
+     if (flags & TCL_INTERP_DESTROYED)
+     {
+          return;
+     }
+     
+     OwnersMap::iterator it =
+          owners.find(static_cast<OwnersMap::value_type *>(cd)->first);
+     OwnedCallbacks owned;
+     owned.swap(it->second);
+     owners.erase(it);
+     
+     for (std::size_t i = 0; i != owned.size(); ++i)
+     {
+          releaseOwned(interp, owned[i]);
+     }
+}
+
+namespace { // anonymous
+
+// the option or binding that the callback in the given word is set for
+// by the command (empty if it cannot be replaced by another callback)
+std::string callbackContext(std::vector<std::string> const &words,
+     std::size_t i)
+{
+     std::size_t n = words.size();
+     // the options are set in the same places by the widget creation
+     if (n >= 4 && (words[1] == "configure" || isWidgetCommand(words[0])) &&
+          i % 2 == 1 && words[i - 1][0] == '-')
+     {
+          return words[i - 1];
+     }
+     
+     // the bound script is the last word; the script that starts with +
+     // is appended to the binding and does not replace its callback
+     if (i + 1 != n)
+     {
+          return std::string();
+     }
+     std::string::size_type first = words[i].find_first_not_of(" \t\n");
+     if (first != std::string::npos && words[i][first] == '+')
+     {
+          return std::string();
+     }
+     if (n == 4 && words[0] == "bind")
+     {
+          return "bind " + words[2];
+     }
+     if (n == 5 && words[1] == "bind")
+     {
+          return "bind " + words[2] + ' ' + words[3];
+     }
+     if (n == 6 && words[1] == "tag" && words[2] == "bind")
+     {
+          return "tag bind " + words[3] + ' ' + words[4];
+     }
+     if (n == 5 && words[0] == "wm" && words[1] == "protocol")
+     {
+          return "protocol " + words[3];
+     }
+     return std::string();
+}
+
+// gives the callbacks mentioned in the command to the widget that the
+// command refers to (the first of the first three words that is a path);
+// the callbacks are no longer orphans after that, even if there is
+// no such widget (for example, in after or bind all), so that the later
+// commands are not checked for them; the callbacks of the command that
+// failed are not referred to by Tk and are deleted at once
+void adoptCallbacks(std::vector<std::string> const &words, bool ok)
+{
+     std::string::size_type callbackLen = std::strlen(callbackPrefix);
+     std::string::size_type dispatchLen = std::strlen(dispatchCommand);
+     
+     // the callbacks, together with the words they are in
+     std::vector<std::pair<std::size_t, OwnedCallback> > adopted;
+     for (std::size_t i = 0; i != words.size(); ++i)
+     {
+          std::string const &word = words[i];
+          
+          // the common part of the names of both kinds of callbacks
+          std::string::size_type pos = word.find("CppTk::");
+          while (pos != std::string::npos)
+          {
+               bool found = true;
+               OwnedCallback cb;
+               cb.key = 0;
+               cb.generation = 0;
+               if (word.compare(pos, callbackLen, callbackPrefix) == 0)
+               {
+                    pos += callbackLen;
+                    cb.key = std::atoi(word.c_str() + pos);
+               }
+               else if (word.compare(pos, dispatchLen, dispatchCommand) == 0)
+               {
+                    pos += dispatchLen;
+                    int slot;
+                    parseDispatch(word.c_str() + pos, slot, cb.generation);
+                    cb.key = dispatchKey(slot);
+               }
+               else
+               {
+                    pos += 7;
+                    found = false;
+               }
+               
+               if (found && orphans.erase(cb.key) != 0)
+               {
+                    adopted.push_back(std::make_pair(i, cb));
+               }
+               pos = word.find("CppTk::", pos);
+          }
+     }
+     if (adopted.empty())
+     {
+          return;
+     }
+     
+     Tcl_Interp *interp = getInterp();
+     if (!ok)
+     {
+          for (std::size_t i = 0; i != adopted.size(); ++i)
+          {
+               releaseOwned(interp, adopted[i].second);
+          }
+          return;
+     }
+     
+     std::size_t w = 0;
+     while (w != words.size() && w != 3 &&
+          (words[w].empty() || words[w][0] != '.'))
+     {
+          ++w;
+     }
+     if (w == words.size() || w == 3)
+     {
+          return;
+     }
+     
+     OwnersMap::iterator it = owners.find(words[w]);
+     if (it == owners.end())
+     {
+          // the widget command has to exist to be traced
+          Tcl_CmdInfo info;
+          if (Tcl_GetCommandInfo(interp, words[w].c_str(), &info) == 0)
+          {
+               return;
+          }
+          
+          it = owners.insert(std::make_pair(words[w], OwnedCallbacks())).first;
+          Tcl_TraceCommand(interp, words[w].c_str(), TCL_TRACE_DELETE,
+               ownerDeleted, static_cast<ClientData>(&*it));
+     }
+     
+     OwnedCallbacks &owned = it->second;
+     for (std::size_t i = 0; i != adopted.size(); ++i)
+     {
+          OwnedCallback &cb = adopted[i].second;
+          cb.context = callbackContext(words, adopted[i].first);
+          
+          // the callback that was replaced is released
+          if (!cb.context.empty())
+          {
+               for (std::size_t j = 0; j != owned.size(); )
+               {
+                    if (owned[j].context == cb.context)
+                    {
+                         OwnedCallback replaced(owned[j]);
+                         owned.erase(owned.begin() + j);
+                         releaseOwned(interp, replaced);
+                    }
+                    else
+                    {
+                         ++j;
+                    }
+               }
+          }
+          owned.push_back(cb);
+     }
+}
+
+// splits the command into words (with the quoting rules of lists,
+// or at spaces if the command is not a proper list)
+void splitCommand(std::string const &cmd, std::vector<std::string> &words)
+{
+     int argc;
+     CONST char **argv;
+     if (Tcl_SplitList(NULL, cmd.c_str(), &argc, &argv) != TCL_OK)
+     {
+          splitAtSpaces(cmd, words, std::string::npos);
+          return;
+     }
+     words.assign(argv, argv + argc);
+     Tcl_Free(reinterpret_cast<char *>(argv));
+}
+
+// adopts the callbacks of the command given as a string
+void adoptCallbacks(std::string const &cmd, bool ok)
+{
+     if (!orphans.empty() && cmd.find("CppTk::") != std::string::npos)
+     {
+          std::vector<std::string> names;
+          splitCommand(cmd, names);
+          adoptCallbacks(names, ok);
+     }
+}
+
+// adopts the callbacks of the command given as a list of words
+void adoptCallbacks(std::vector<Tcl_Obj *> const &words, bool ok)
+{
+     std::vector<std::string> names;
+     for (std::size_t i = 0; i != words.size(); ++i)
+     {
+          names.push_back(Tcl_GetString(words[i]));
+     }
+     adoptCallbacks(names, ok);
+}
+
+} // namespace anonymous
+
+// reports errors from handlers that have no script to return them to
+void Tk::details::backgroundError(std::exception const &e)
+{
+     Tcl_SetResult(getInterp(), const_cast<char*>(e.what()), TCL_VOLATILE);
+     Tcl_BackgroundException(getInterp(), TCL_ERROR);
+}
+
+// generic file descriptor handler
+
+#ifndef _WIN32
+extern "C"
+void fdHandler(ClientData cd, int mask)
+{
+     int fd = static_cast<int>(reinterpret_cast<size_t>(cd));
+
+     FdHandlersMap::iterator it = fdHandlers.find(fd);
+     if (it == fdHandlers.end())
+     {
+          return;
+     }
+
+     int events = 0;
+     if (mask & TCL_READABLE)  events |= readable;
+     if (mask & TCL_WRITABLE)  events |= writable;
+     if (mask & TCL_EXCEPTION) events |= exceptional;
+
+     TraceSpan span("watchFd", "fd");
+     
+     // the handler can unwatch its own descriptor
+     std::shared_ptr<FdHandler> h(it->second);
+     Watch watch("fd", "watchFd", NULL, &h->target_type());
+     try
+     {
+          // refresh C++ variables
+          linkTcltoCpp();
+
+          (*h)(events);
+
+          // refresh Tcl variables
+          linkCpptoTcl();
+     }
+     catch (std::exception const &e)
+     {
+          backgroundError(e);
+     }
+}
+#endif // _WIN32
+
+std::string Tk::details::addCallback(std::shared_ptr<CallbackBase> cb,
+     bool owned)
+{
+     if (dispatchEnabled)
+     {
+          int slot;
+          if (freeSlots.empty())
+          {
+               if (dispatchTable.empty())
+               {
+                    Tcl_CreateObjCommand(getInterp(), dispatchCommand,
+                         dispatchHandler, 0, 0);
+               }
+               slot = static_cast<int>(dispatchTable.size());
+               dispatchTable.push_back(cb);
+               dispatchGenerations.push_back(0);
+          }
+          else
+          {
+               slot = freeSlots.back();
+               freeSlots.pop_back();
+               dispatchTable[slot] = cb;
+          }
+          if (owned)
+          {
+               orphans.insert(dispatchKey(slot));
+          }
+          
+          std::string name(dispatchCommand);
+          name += ' ';
+          name += std::to_string(slot);
+          name += ' ';
+          name += std::to_string(dispatchGenerations[slot]);
+          return name;
+     }
+     
+     int newSlot = callbackId++;
+     callbacks[newSlot] = cb;
+     if (owned)
+     {
+          orphans.insert(newSlot);
+     }
+     
+     std::string newCmd(callbackPrefix);
+     newCmd += std::to_string(newSlot);
+     
+     Tcl_CreateObjCommand(getInterp(), newCmd.c_str(),
+          callbackHandler, reinterpret_cast<ClientData>(
+			static_cast<size_t>(newSlot)),
+          callbackDeleter);
+     
+     return newCmd;
+}
+
+std::string Tk::details::addNamedCallback(std::string const &name,
+     std::shared_ptr<CallbackBase> cb)
+{
+     if (name.empty() ||
+          name.find_first_of(" \t\n;[]{}\"\\$") != std::string::npos)
+     {
+          throw TkError("Invalid callback name: " + name);
+     }
+     
+     // the named callbacks have negative slots,
+     // so that they do not change the names of the other callbacks
+     int newSlot = --namedCallbackId;
+     callbacks[newSlot] = cb;
+     
+     std::string newCmd(namedCallbackPrefix);
+     newCmd += name;
+     
+     // the previous callback with this name is deleted by Tcl
+     Tcl_CreateObjCommand(getInterp(), newCmd.c_str(),
+          callbackHandler, reinterpret_cast<ClientData>(
+               static_cast<size_t>(newSlot)),
+          callbackDeleter);
+     
+     return newCmd;
+}
+
+std::string Tk::details::addLinkVar(int &i)
+{
+     int newLink = linkId++;
+     std::string newLinkVar(linkVarPrefix);
+     newLinkVar += std::to_string(newLink);
+     
+     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
+          reinterpret_cast<char*>(&i), TCL_LINK_INT);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     
+     intLinks[&i] = newLinkVar;
+     return newLinkVar;
+}
+
+std::string Tk::details::addLinkVar(double &d)
+{
+     int newLink = linkId++;
+     std::string newLinkVar(linkVarPrefix);
+     newLinkVar += std::to_string(newLink);
+     
+     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
+          reinterpret_cast<char*>(&d), TCL_LINK_DOUBLE);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     
+     doubleLinks[&d] = newLinkVar;
+     return newLinkVar;
+}
+
+std::string Tk::details::addLinkVar(std::string &s)
+{
+     int newLink = linkId++;
+     std::string newLinkVar(linkVarPrefix);
+     newLinkVar += std::to_string(newLink);
+     
+     std::pair<std::map<std::string *, char *>::iterator, bool> it =
+          stringLinkBuffers.insert(make_pair(&s, static_cast<char*>(NULL)));
+     
+     char *&pb = it.first->second;
+     pb = Tcl_Alloc(static_cast<unsigned int>(s.size()) + 1);
+     copy(s.begin(), s.end(), pb);
+     pb[s.size()] = '\0';
+     
+     int cc = Tcl_LinkVar(getInterp(), newLinkVar.c_str(),
+          reinterpret_cast<char*>(&it.first->second), TCL_LINK_STRING);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     
+     stringLinks[&s] = newLinkVar;
+     return newLinkVar;
+}
+
+void Tk::details::deleteLinkVar(int &i)
+{
+     IntLinks::iterator it = intLinks.find(&i);
+     if (it == intLinks.end())
+     {
+          return;
+     }
+     
+     Tcl_UnlinkVar(getInterp(), it->second.c_str());
+     intLinks.erase(it);
+}
+
+void Tk::details::deleteLinkVar(double &d)
+{
+     DoubleLinks::iterator it = doubleLinks.find(&d);
+     if (it == doubleLinks.end())
+     {
+          return;
+     }
+     
+     Tcl_UnlinkVar(getInterp(), it->second.c_str());
+     doubleLinks.erase(it);
+}
+
+void Tk::details::deleteLinkVar(std::string &s)
+{
+     StringLinks::iterator it = stringLinks.find(&s);
+     if (it == stringLinks.end())
+     {
+          return;
+     }
+     
+     Tcl_UnlinkVar(getInterp(), it->second.c_str());
+     stringLinks.erase(it);
+     
+     StringLinkBuffers::iterator itb = stringLinkBuffers.find(&s);
+     char *pb = itb->second;
+     if (pb != NULL)
+     {
+          Tcl_Free(pb);
+     }
+     
+     stringLinkBuffers.erase(itb);
+}
+
+void Tk::details::setResult(bool b)
+{
+     Tcl_SetObjResult(getInterp(), Tcl_NewBooleanObj(b));
+}
+
+void Tk::details::setResult(long i)
+{
+     Tcl_SetObjResult(getInterp(), Tcl_NewLongObj(i));
+}
+
+void Tk::details::setResult(double d)
+{
+     Tcl_SetObjResult(getInterp(), Tcl_NewDoubleObj(d));
+}
+
+void Tk::details::setResult(std::string const &s)
+{
+     Tcl_SetObjResult(getInterp(),
+          Tcl_NewStringObj(s.data(), static_cast<int>(s.size())));
+}
+
+int Tk::details::getResultLen()
+{
+     Tcl_Interp *interp = getInterp();
+     
+     Tcl_Obj *list = Tcl_GetObjResult(interp);
+     int len, cc;
+     
+     cc = Tcl_ListObjLength(interp, list, &len);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return len;
+}
+
+template <>
+int Tk::details::getResultElem<int>(int indx)
+{
+     Tcl_Interp *interp = getInterp();
+
+     Tcl_Obj *list = Tcl_GetObjResult(interp);
+     Tcl_Obj *obj;
+     
+     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     int val;
+     cc = Tcl_GetIntFromObj(interp, obj, &val);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return val;
+}
+
+template <>
+double Tk::details::getResultElem<double>(int indx)
+{
+     Tcl_Interp *interp = getInterp();
+
+     Tcl_Obj *list = Tcl_GetObjResult(interp);
+     Tcl_Obj *obj;
+     
+     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     double val;
+     cc = Tcl_GetDoubleFromObj(interp, obj, &val);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return val;
+}
+
+template <>
+std::string Tk::details::getResultElem<std::string>(int indx)
+{
+     Tcl_Interp *interp = getInterp();
+
+     Tcl_Obj *list = Tcl_GetObjResult(interp);
+     Tcl_Obj *obj;
+     
+     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return Tcl_GetString(obj);
+}
+
+Tk::details::ObjRef::ObjRef(void *obj) : obj_(obj)
+{
+     if (obj_ != NULL)
+     {
+          Tcl_IncrRefCount(static_cast<Tcl_Obj *>(obj_));
+     }
+}
+
+Tk::details::ObjRef::ObjRef(ObjRef const &other) : obj_(other.obj_)
+{
+     if (obj_ != NULL)
+     {
+          Tcl_IncrRefCount(static_cast<Tcl_Obj *>(obj_));
+     }
+}
+
+Tk::details::ObjRef::~ObjRef()
+{
+     if (obj_ != NULL)
+     {
+          Tcl_DecrRefCount(static_cast<Tcl_Obj *>(obj_));
+     }
+}
+
+ObjRef & Tk::details::ObjRef::operator=(ObjRef const &other)
+{
+     ObjRef tmp(other);
+     std::swap(obj_, tmp.obj_);
+     return *this;
+}
+
+ObjRef Tk::details::makeList(double const *xy, std::size_t n)
+{
+     Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+     ObjRef ret(list);
+     for (std::size_t i = 0; i != n; ++i)
+     {
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewDoubleObj(xy[i]));
+     }
+     
+     return ret;
+}
+
+ObjRef Tk::details::makeList(Point const *p, std::size_t n)
+{
+     Tcl_Obj *list = Tcl_NewListObj(0, NULL);
+     ObjRef ret(list);
+     for (std::size_t i = 0; i != n; ++i)
+     {
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(p[i].x));
+          Tcl_ListObjAppendElement(NULL, list, Tcl_NewIntObj(p[i].y));
+     }
+     
+     return ret;
+}
+
+ObjRef Tk::details::makeObj(std::string const &s)
+{
+     return ObjRef(Tcl_NewStringObj(s.data(), static_cast<int>(s.size())));
+}
+
+details::Command::Command(std::string const &str, std::string const &postfix)
+     : invoked_(false), ok_(false), str_(str), postfix_(postfix)
+{
+}
+
+details::Command::~Command()
+{
+     if (!TkError::inTkError())
+     {
+          invokeOnce();
+     }
+}
+
+std::string Tk::details::Command::invoke() const
+{
+     invokeOnce();
+     return Tcl_GetStringResult(getInterp());
+}
+
+void Tk::details::Command::prepend(std::string const &str)
+{
+     str_.insert(0, str);
+     for (ObjWords::iterator it = objs_.begin(); it != objs_.end(); ++it)
+     {
+          it->first += str.size();
+     }
+}
+
+void Tk::details::Command::appendObj(ObjRef const &obj)
+{
+     objs_.push_back(std::make_pair(str_.size(), obj));
+}
+
+void Tk::details::Command::prependObj(ObjRef const &obj)
+{
+     objs_.insert(objs_.begin(), std::make_pair(0, obj));
+}
+
+bool Tk::details::Command::invokeOnce() const
+{
+     // the outcome stays false if the evaluation throws
+     if (!invoked_)
+     {
+          invoked_ = true;
+          ok_ = evaluate();
+     }
+     return ok_;
+}
+
+bool Tk::details::Command::evaluate() const
+{
+     bool ok;
+     if (objs_.empty() || needsParsing(str_ + postfix_))
+     {
+          // the object words (if any) are quoted into the script
+          std::string cmd;
+          std::string::size_type pos = 0;
+          for (ObjWords::const_iterator it = objs_.begin();
+               it != objs_.end(); ++it)
+          {
+               appendText(cmd, str_.substr(pos, it->first - pos),
+                    it != objs_.begin());
+               appendQuoted(cmd, static_cast<Tcl_Obj *>(it->second.get()));
+               pos = it->first;
+          }
+          appendText(cmd, str_.substr(pos) + postfix_, objs_.empty() == false);
+          
+          if (cacheEvaluated && cacheEnabled && evalCached(cmd, ok))
+          {
+               return ok;
+          }
+          
+          try
+          {
+               if (shadowEnabled && shadowCandidate(cmd))
+               {
+                    ok = do_eval_shadowed(cmd);
+               }
+               else
+               {
+                    ok = do_eval(cmd);
+               }
+          }
+          catch (TkError const &)
+          {
+               adoptCallbacks(cmd, false);
+               throw;
+          }
+          adoptCallbacks(cmd, ok);
+          return ok;
+     }
+     
+     // the command carries ready objects and plain words,
+     // so it is evaluated word by word, without reparsing them
+     std::vector<Tcl_Obj *> words;
+     ObjGuard guard;
+     std::string::size_type pos = 0;
+     for (ObjWords::const_iterator it = objs_.begin();
+          it != objs_.end(); ++it)
+     {
+          if (appendWords(words, guard,
+                    str_.substr(pos, it->first - pos)) == false)
+          {
+               return false;
+          }
+          words.push_back(static_cast<Tcl_Obj *>(it->second.get()));
+          pos = it->first;
+     }
+     std::string rest(str_.substr(pos));
+     rest += postfix_;
+     if (appendWords(words, guard, rest) == false)
+     {
+          return false;
+     }
+     
+     if (cacheEvaluated && cacheEnabled && evalCached(words, ok))
+     {
+          return ok;
+     }
+     
+     // the object words never carry callbacks
+     bool callbacks = !orphans.empty() &&
+          (str_ + postfix_).find("CppTk::") != std::string::npos;
+     try
+     {
+          if (shadowEnabled)
+          {
+               ok = do_eval_shadowed(words);
+          }
+          else
+          {
+               ok = do_eval_objv(words);
+          }
+     }
+     catch (TkError const &)
+     {
+          if (callbacks)
+          {
+               adoptCallbacks(words, false);
+          }
+          throw;
+     }
+     if (callbacks)
+     {
+          adoptCallbacks(words, ok);
+     }
+     return ok;
+}
+
+details::Expr::Expr(std::string const &str, bool starter)
+{
+     if (starter)
+     {
+          cmd_.reset(new Command(str));
+     }
+     else
+     {
+          str_ = str;
+     }
+}
+
+details::Expr::Expr(std::string const &str, std::string const &postfix)
+{
+     cmd_.reset(new Command(str, postfix));
+}
+
+std::string Tk::details::Expr::getValue() const
+{
+     if (!str_.empty())
+     {
+          return str_;
+     }
+     else
+     {
+          return cmd_->getValue();
+     }
+}
+
+details::Expr::operator std::string() const
+{
+     return cmd_->invoke();
+}
+
+details::Expr::operator int() const
+{
+     cmd_->invokeOnce();
+     
+     Tcl_Interp *interp = getInterp();
+     Tcl_Obj *obj = Tcl_GetObjResult(interp);
+
+     int val, cc;
+     cc = Tcl_GetIntFromObj(interp, obj, &val);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return val;
+}
+
+details::Expr::operator double() const
+{
+     cmd_->invokeOnce();
+     
+     Tcl_Interp *interp = getInterp();
+     Tcl_Obj *obj = Tcl_GetObjResult(interp);
+     
+     double val;
+     int cc = Tcl_GetDoubleFromObj(interp, obj, &val);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(interp));
+     }
+     
+     return val;
+}
+
+details::Expr::operator Tk::Point() const
+{
+     std::string ret(cmd_->invoke());
+     if (ret.empty())
+     {
+          return Tk::Point(0, 0);
+     }
+
+     int len = getResultLen();
+     if (len < 2)
+     {
+          throw TkError("Cannot convert the result list to Point\n");
+     }
+     
+     int x = getResultElem<int>(0);
+     int y = getResultElem<int>(1);
+     
+     return Point(x, y);
+}
+
+details::Expr::operator Tk::Box() const
+{
+     std::string ret(cmd_->invoke());
+     if (ret.empty())
+     {
+          return Tk::Box(0, 0, 0, 0);
+     }
+     
+     int len = getResultLen();
+     if (len < 4)
+     {
+          throw TkError("Cannot convert the result list to Box\n");
+     }
+     
+     int x1 = getResultElem<int>(0);
+     int y1 = getResultElem<int>(1);
+     int x2 = getResultElem<int>(2);
+     int y2 = getResultElem<int>(3);
+     
+     return Box(x1, y1, x2, y2);
+}
+
+// these specializations are used to extract parameter
+// with the requested type
+
+template <>
+int Tk::details::Params::get<int>(int argno) const
+{
+     if (argno < 1 || argno >= argc_)
+     {
+          throw TkError("Parameter number out of valid range");
+     }
+     
+     Tcl_Obj *CONST *objv = reinterpret_cast<Tcl_Obj *CONST *>(objv_);
+     
+     int res, cc;
+     cc = Tcl_GetIntFromObj(getInterp(), objv[argno], &res);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     
+     return res;
+}
+
+template <>
+double Tk::details::Params::get<double>(int argno) const
+{
+     if (argno < 1 || argno >= argc_)
+     {
+          throw TkError("Parameter number out of valid range");
+     }
+     
+     Tcl_Obj *CONST *objv = reinterpret_cast<Tcl_Obj *CONST *>(objv_);
+     
+     double res;
+     int cc = Tcl_GetDoubleFromObj(getInterp(), objv[argno], &res);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     
+     return res;
+}
+
+template <>
+std::string Tk::details::Params::get<std::string>(int argno) const
+{
+     if (argno < 1 || argno >= argc_)
+     {
+          throw TkError("Parameter number out of valid range");
+     }
+     
+     Tcl_Obj *CONST *objv = reinterpret_cast<Tcl_Obj *CONST *>(objv_);
+     
+     std::string res = Tcl_GetString(objv[argno]);
+     return res;
+}
+
+// non-throwing evaluation
+
+namespace { // anonymous
+
+// evaluates the expression, leaving the error in the interpreter
+bool tryInvoke(Expr const &e)
+{
+     ErrorMode quiet(false);
+     return e.getCmd()->invokeOnce();
+}
+
+template <typename T>
+Result<T> failure()
+{
+     Tcl_Interp *interp = getInterp();
+     std::string error(Tcl_GetStringResult(interp));
+     
+     std::string code;
+     Tcl_Obj *options = Tcl_GetReturnOptions(interp, TCL_ERROR);
+     Tcl_IncrRefCount(options);
+     Tcl_Obj *key = Tcl_NewStringObj("-errorcode", -1);
+     Tcl_IncrRefCount(key);
+     Tcl_Obj *value;
+     if (Tcl_DictObjGet(NULL, options, key, &value) == TCL_OK &&
+          value != NULL)
+     {
+          code = Tcl_GetString(value);
+     }
+     Tcl_DecrRefCount(key);
+     Tcl_DecrRefCount(options);
+     
+     return Result<T>(error, code);
+}
+
+} // namespace anonymous
+
+template <>
+Result<std::string> Tk::try_<std::string>(Expr const &e)
+{
+     if (tryInvoke(e) == false)
+     {
+          return failure<std::string>();
+     }
+     return Result<std::string>(Tcl_GetStringResult(getInterp()));
+}
+
+template <>
+Result<int> Tk::try_<int>(Expr const &e)
+{
+     int val;
+     if (tryInvoke(e) == false ||
+          Tcl_GetIntFromObj(getInterp(),
+               Tcl_GetObjResult(getInterp()), &val) != TCL_OK)
+     {
+          return failure<int>();
+     }
+     return Result<int>(val);
+}
+
+template <>
+Result<double> Tk::try_<double>(Expr const &e)
+{
+     double val;
+     if (tryInvoke(e) == false ||
+          Tcl_GetDoubleFromObj(getInterp(),
+               Tcl_GetObjResult(getInterp()), &val) != TCL_OK)
+     {
+          return failure<double>();
+     }
+     return Result<double>(val);
+}
+
+template <>
+Result<bool> Tk::try_<bool>(Expr const &e)
+{
+     int val;
+     if (tryInvoke(e) == false ||
+          Tcl_GetBooleanFromObj(getInterp(),
+               Tcl_GetObjResult(getInterp()), &val) != TCL_OK)
+     {
+          return failure<bool>();
+     }
+     return Result<bool>(val != 0);
+}
+
+std::ostream & Tk::details::operator<<(std::ostream &os, BasicToken const &token)
+{
+     return os << static_cast<std::string>(token);
+}
+
+namespace { // anonymous
+
+void doSingleQuote(std::string &s, char c)
+{
+     std::string::size_type pos = 0;
+     while ((pos = s.find(c, pos)) != std::string::npos)
+     {
+          s.insert(pos, "\\");
+          pos += 2;
+     }
+}
+
+} // namespace anonymous
+
+// this function is used to quote quotation marks in string values'
+// in later version, it will not be needed
+std::string Tk::details::quote(std::string const &s)
+{
+     std::string ret(s);
+     doSingleQuote(ret, '\\');
+     doSingleQuote(ret, '\"');
+     doSingleQuote(ret, '$');
+     doSingleQuote(ret, '[');
+     doSingleQuote(ret, ']');
+     
+     return ret;
+}
+
+// basic Tk expression operations
+
+Expr Tk::operator-(Expr const &lhs, Expr const &rhs)
+{
+     std::shared_ptr<Command> cmd(lhs.getCmd());
+     cmd->append(rhs.getValue());
+     
+     return Expr(cmd);
+}
+
+Expr Tk::operator<<(std::string const &w, Expr const &rhs)
+{
+     std::shared_ptr<Command> cmd(rhs.getCmd());
+     cmd->prepend(" ");
+     cmd->prepend(w);
+
+     return Expr(cmd);
+}
+
+// helper functions
+
+void Tk::deleteCallback(std::string const &name)
+{
+     std::string::size_type len = std::strlen(dispatchCommand);
+     if (name.compare(0, len, dispatchCommand) == 0)
+     {
+          int slot;
+          unsigned generation;
+          parseDispatch(name.c_str() + len, slot, generation);
+          releaseSlot(slot, generation);
+          return;
+     }
+     
+     // the named callbacks are forgotten by their deleter
+     // (the name can be followed by the substitutions)
+     len = std::strlen(namedCallbackPrefix);
+     if (name.compare(0, len, namedCallbackPrefix) == 0)
+     {
+          std::string cmd(name.substr(0, name.find(' ')));
+          if (Tcl_DeleteCommand(getInterp(), cmd.c_str()) != TCL_OK)
+          {
+               throw TkError(Tcl_GetStringResult(getInterp()));
+          }
+          return;
+     }
+     
+     std::string::size_type pos = name.find_first_not_of(callbackPrefix);
+     if (pos == std::string::npos) return;
+     
+     int slot = std::stoi(name.substr(pos, name.size()));
+     callbacks.erase(slot);
+     
+     int cc = Tcl_DeleteCommand(getInterp(), name.c_str());
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+}
+
+std::size_t Tk::liveCallbacks()
+{
+     return callbacks.size() + dispatchTable.size() - freeSlots.size();
+}
+
+void Tk::enableCallbackDispatch(bool enable)
+{
+     dispatchEnabled = enable;
+}
+
+Tk::CallbackHandle::CallbackHandle(std::string const &name) : name_(name) {}
+
+Tk::CallbackHandle::~CallbackHandle() { deleteCallback(name_); }
+
+// timers
+
+namespace { // anonymous
+
+extern "C" void wheelTimerProc(ClientData);
+
+// Hierarchical timer wheel with 1ms ticks - the first level has a slot
+// for each of the next 256 ticks, each of the next levels has 64 slots
+// covering 64 times longer periods, and the timers are moved down
+// (cascaded) when the lower level wraps.
+// The wheel is driven by a single Tcl timer, set for the earliest tick
+// that can have something to do.
+class TimerWheel
+{
+public:
+     typedef std::function<void ()> Task;
+
+     TimerWheel() : nextId_(1), base_(0), timer_(0), armedAt_(0)
+     {
+          epoch_ = Clock::now();
+     }
+
+     long add(int delay, int interval, Task const &t)
+     {
+          if (timers_.empty())
+          {
+               // nothing to catch up with
+               base_ = now();
+          }
+
+          long id = nextId_++;
+          Entry &e = timers_[id];
+          e.expires = now() + (delay > 0 ? delay : 0);
+          e.interval = interval;
+          e.task.reset(new Task(t));
+          insert(id, e);
+
+          if (timer_ == 0 || e.expires < armedAt_)
+          {
+               arm();
+          }
+          return id;
+     }
+
+     void remove(long id)
+     {
+          Timers::iterator it = timers_.find(id);
+          if (it == timers_.end())
+          {
+               return;
+          }
+
+          Entry &e = it->second;
+          if (e.level >= 0)
+          {
+               slots_[e.level][e.slot].erase(e.pos);
+          }
+          timers_.erase(it);
+
+          // the Tcl timer is left as it is, it will find nothing to do
+          // or will be set again for the next timer
+     }
+
+     bool exists(long id) const { return timers_.count(id) != 0; }
+
+     // runs the timers that have expired until now
+     void run()
+     {
+          timer_ = 0;
+
+          // refresh C++ variables
+          linkTcltoCpp();
+
+          long long now = this->now();
+          while (base_ <= now)
+          {
+               int index = static_cast<int>(base_ & 255);
+               if (index == 0 &&
+                    cascade(1, level(1)) == 0 &&
+                    cascade(2, level(2)) == 0)
+               {
+                    cascade(3, level(3));
+               }
+               ++base_;
+
+               Slot &slot = slots_[0][index];
+               while (!slot.empty())
+               {
+                    long id = slot.front();
+                    slot.pop_front();
+                    fire(id);
+               }
+          }
+
+          // refresh Tcl variables
+          linkCpptoTcl();
+
+          if (!timers_.empty())
+          {
+               arm();
+          }
+     }
+
+private:
+     typedef std::chrono::steady_clock Clock;
+     typedef std::list<long> Slot;
+
+     struct Entry
+     {
+          long long expires;
+          int interval;
+          std::shared_ptr<Task> task;
+
+          // position in the wheel, level is -1 when the timer runs
+          int level;
+          int slot;
+          Slot::iterator pos;
+     };
+
+     typedef std::map<long, Entry> Timers;
+
+     long long now() const
+     {
+          return std::chrono::duration_cast<std::chrono::milliseconds>(
+               Clock::now() - epoch_).count();
+     }
+
+     // index of the slot in the given level, that is cascaded now
+     int level(int n) const
+     {
+          return static_cast<int>((base_ >> (8 + (n - 1) * 6)) & 63);
+     }
+
+     void insert(long id, Entry &e)
+     {
+          long long expires = e.expires;
+          long long idx = expires - base_;
+          if (idx < 0)
+          {
+               // already expired, run it with the next tick
+               expires = base_;
+               idx = 0;
+          }
+          else if (idx >= (1LL << 26))
+          {
+               // too far away, it will be cascaded again
+               expires = base_ + (1LL << 26) - 1;
+               idx = (1LL << 26) - 1;
+          }
+
+          if (idx < 256)
+          {
+               e.level = 0;
+               e.slot = static_cast<int>(expires & 255);
+          }
+          else
+          {
+               int n = idx < (1LL << 14) ? 1 : idx < (1LL << 20) ? 2 : 3;
+               e.level = n;
+               e.slot = static_cast<int>((expires >> (8 + (n - 1) * 6)) & 63);
+          }
+
+          Slot &slot = slots_[e.level][e.slot];
+          e.pos = slot.insert(slot.end(), id);
+     }
+
+     // moves the timers from the given slot to the lower levels
+     int cascade(int n, int index)
+     {
+          Slot slot;
+          slot.swap(slots_[n][index]);
+          for (Slot::iterator it = slot.begin(); it != slot.end(); ++it)
+          {
+               insert(*it, timers_[*it]);
+          }
+          return index;
+     }
+
+     void fire(long id)
+     {
+          Timers::iterator it = timers_.find(id);
+          Entry &e = it->second;
+          e.level = -1;
+
+          // the task can add and remove timers (also itself)
+          std::shared_ptr<Task> task(e.task);
+          char const *name = e.interval == 0 ? "setTimeout" : "setInterval";
+          if (e.interval == 0)
+          {
+               timers_.erase(it);
+          }
+
+          try
+          {
+               TraceSpan span(name, "timer");
+               Watch watch("timer", name, NULL, &task->target_type());
+               (*task)();
+          }
+          catch (std::exception const &ex)
+          {
+               backgroundError(ex);
+          }
+
+          it = timers_.find(id);
+          if (it != timers_.end() && it->second.level == -1)
+          {
+               // intervals do not drift, but the periods that were
+               // missed (when the application was busy) are skipped
+               Entry &r = it->second;
+               r.expires += r.interval;
+               if (r.expires < base_)
+               {
+                    r.expires = base_ - 1 + r.interval;
+               }
+               insert(id, r);
+          }
+     }
+
+     // the earliest tick that can have something to do
+     long long next() const
+     {
+          long long best = base_ + 256;
+          for (int k = 0; k != 256; ++k)
+          {
+               if (!slots_[0][(base_ + k) & 255].empty())
+               {
+                    best = base_ + k;
+                    break;
+               }
+          }
+
+          for (int n = 1; n != 4; ++n)
+          {
+               int shift = 8 + (n - 1) * 6;
+               long long step = 1LL << shift;
+               long long t = ((base_ + step - 1) >> shift) << shift;
+               for (int m = 0; m != 64 && t < best; ++m, t += step)
+               {
+                    if (!slots_[n][(t >> shift) & 63].empty())
+                    {
+                         best = t;
+                         break;
+                    }
+               }
+          }
+          return best;
+     }
+
+     void arm()
+     {
+          if (timer_ != 0)
+          {
+               Tcl_DeleteTimerHandler(static_cast<Tcl_TimerToken>(timer_));
+          }
+
+          armedAt_ = next();
+          long long delay = armedAt_ - now();
+          timer_ = Tcl_CreateTimerHandler(
+               delay > 0 ? static_cast<int>(delay) : 0, wheelTimerProc, 0);
+     }
+
+     Clock::time_point epoch_;
+     Timers timers_;
+     long nextId_;
+
+     // the next tick to be processed
+     long long base_;
+     Slot slots_[4][256];
+
+     void *timer_;
+     long long armedAt_;
+};
+
+TimerWheel & timerWheel()
+{
+     static TimerWheel wheel;
+     return wheel;
+}
+
+extern "C"
+void wheelTimerProc(ClientData)
+{
+     timerWheel().run();
+}
+
+} // namespace anonymous
+
+long Tk::setTimeout(int delay, std::function<void ()> const &f)
+{
+     return timerWheel().add(delay, 0, f);
+}
+
+long Tk::setInterval(int interval, std::function<void ()> const &f)
+{
+     // at least one tick, otherwise the interval would never end
+     if (interval < 1)
+     {
+          interval = 1;
+     }
+     return timerWheel().add(interval, interval, f);
+}
+
+void Tk::clearTimer(long id)
+{
+     timerWheel().remove(id);
+}
+
+bool Tk::timerActive(long id)
+{
+     return timerWheel().exists(id);
+}
+
+Tk::TimerHandle::TimerHandle(long id) : id_(id) {}
+
+Tk::TimerHandle::~TimerHandle() { clearTimer(id_); }
+
+// frame scheduler
+
+extern "C"
+void frameTimerProc(ClientData cd)
+{
+     static_cast<FrameScheduler*>(cd)->runFrame();
+}
+
+Tk::FrameScheduler::FrameScheduler(int fps)
+     : fps_(fps > 0 ? fps : 60), timer_(0), frames_(0),
+       lastTime_(0.0), totalTime_(0.0), maxTime_(0.0)
+{
+}
+
+Tk::FrameScheduler::~FrameScheduler()
+{
+     if (timer_ != 0)
+     {
+          Tcl_DeleteTimerHandler(static_cast<Tcl_TimerToken>(timer_));
+     }
+}
+
+void Tk::FrameScheduler::setFps(int fps)
+{
+     fps_ = fps > 0 ? fps : 60;
+}
+
+void Tk::FrameScheduler::request(std::string const &key, Task const &t)
+{
+     std::map<std::string, std::size_t>::iterator it = index_.find(key);
+     if (it != index_.end())
+     {
+          tasks_[it->second].second = t;
+          return;
+     }
+
+     index_[key] = tasks_.size();
+     tasks_.push_back(std::make_pair(key, t));
+
+     if (timer_ == 0)
+     {
+          // the frames are not run more often than fps times per second
+          Clock::duration period = std::chrono::microseconds(1000000 / fps_);
+          Clock::duration wait = lastFrame_ + period - Clock::now();
+          long ms = static_cast<long>(std::chrono::duration_cast<
+               std::chrono::milliseconds>(wait + std::chrono::microseconds(999))
+               .count());
+
+          timer_ = Tcl_CreateTimerHandler(ms > 0 ? static_cast<int>(ms) : 0,
+               frameTimerProc, static_cast<ClientData>(this));
+     }
+}
+
+void Tk::FrameScheduler::cancel(std::string const &key)
+{
+     std::map<std::string, std::size_t>::iterator it = index_.find(key);
+     if (it != index_.end())
+     {
+          // the slot is kept, so that the indexes stay valid
+          tasks_[it->second].second = Task();
+          index_.erase(it);
+     }
+}
+
+void Tk::FrameScheduler::runFrame()
+{
+     if (timer_ != 0)
+     {
+          Tcl_DeleteTimerHandler(static_cast<Tcl_TimerToken>(timer_));
+          timer_ = 0;
+     }
+
+     TraceSpan span("frame", "frame");
+     Watch watch("frame", "FrameScheduler", NULL, NULL);
+     
+     Clock::time_point start = Clock::now();
+     lastFrame_ = start;
+
+     // the tasks requested while running this frame
+     // go to the next one
+     std::vector<std::pair<std::string, Task> > tasks;
+     tasks.swap(tasks_);
+     index_.clear();
+
+     for (std::size_t i = 0; i != tasks.size(); ++i)
+     {
+          if (!tasks[i].second)
+          {
+               continue;
+          }
+
+          try
+          {
+               tasks[i].second();
+          }
+          catch (std::exception const &e)
+          {
+               backgroundError(e);
+          }
+     }
+
+     // the redraws and geometry management done by Tk
+     // are part of the frame
+     {
+          TraceSpan idle("idle", "idle");
+          runIdlePass();
+     }
+
+     lastTime_ = std::chrono::duration<double, std::milli>(
+          Clock::now() - start).count();
+     totalTime_ += lastTime_;
+     if (lastTime_ > maxTime_)
+     {
+          maxTime_ = lastTime_;
+     }
+     ++frames_;
+}
+
+double Tk::FrameScheduler::averageFrameTime() const
+{
+     return frames_ != 0 ? totalTime_ / frames_ : 0.0;
+}
+
+void Tk::FrameScheduler::resetStats()
+{
+     frames_ = 0;
+     lastTime_ = totalTime_ = maxTime_ = 0.0;
+}
+
+// lazy subtrees
+
+namespace { // anonymous
+
+typedef std::map<std::string, std::function<void ()> > LazyBuilders;
+LazyBuilders lazyBuilders;
+
+// the containers to be built in the idle time
+std::deque<std::string> lazyIdleQueue;
+
+char const *lazyTag = "CppTk::lazy";
+char const *lazyCommand = "CppTk::build";
+
+// removes the binding tag and the builder, returns the builder
+std::function<void ()> takeBuilder(std::string const &path)
+{
+     std::function<void ()> builder;
+     LazyBuilders::iterator it = lazyBuilders.find(path);
+     if (it == lazyBuilders.end())
+     {
+          return builder;
+     }
+     builder.swap(it->second);
+     lazyBuilders.erase(it);
+     
+     std::string script("if {[winfo exists ");
+     script += path;
+     script += "]} {bindtags ";
+     script += path;
+     script += " [lsearch -all -inline -not -exact [bindtags ";
+     script += path;
+     script += "] ";
+     script += lazyTag;
+     script += "]}";
+     Tcl_Eval(getInterp(), script.c_str());
+     Tcl_ResetResult(getInterp());
+     return builder;
+}
+
+// builds the subtree from the event loop
+void buildFromEvent(std::string const &path)
+{
+     std::function<void ()> builder(takeBuilder(path));
+     if (!builder)
+     {
+          return;
+     }
+     
+     TraceSpan span(path, "lazy");
+     try
+     {
+          // refresh C++ variables
+          linkTcltoCpp();
+          
+          builder();
+          
+          // refresh Tcl variables
+          linkCpptoTcl();
+     }
+     catch (std::exception const &e)
+     {
+          backgroundError(e);
+     }
+}
+
+extern "C"
+int lazyHandler(ClientData, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[])
+{
+     if (objc == 2)
+     {
+          buildFromEvent(Tcl_GetString(objv[1]));
+     }
+     else if (objc == 3)
+     {
+          // the container is destroyed before it was ever mapped
+          takeBuilder(Tcl_GetString(objv[1]));
+     }
+     return TCL_OK;
+}
+
+extern "C"
+void lazyIdleProc(ClientData)
+{
+     // the next builders wait for the next idle pass,
+     // so that the events are handled in between
+     while (!lazyIdleQueue.empty())
+     {
+          std::string path(lazyIdleQueue.front());
+          lazyIdleQueue.pop_front();
+          if (lazyBuilders.count(path) != 0)
+          {
+               buildFromEvent(path);
+               break;
+          }
+     }
+     
+     if (!lazyIdleQueue.empty())
+     {
+          Tcl_DoWhenIdle(lazyIdleProc, 0);
+     }
+}
+
+} // namespace anonymous
+
+void Tk::buildLazily(std::string const &container,
+     std::function<void ()> const &builder, bool idle)
+{
+     Tcl_Interp *interp = getInterp();
+     
+     static bool registered = false;
+     if (!registered)
+     {
+          std::string script("bind ");
+          script += lazyTag;
+          script += " <Map> {";
+          script += lazyCommand;
+          script += " %W}; bind ";
+          script += lazyTag;
+          script += " <Visibility> {";
+          script += lazyCommand;
+          script += " %W}; bind ";
+          script += lazyTag;
+          script += " <Destroy> {";
+          script += lazyCommand;
+          script += " %W destroyed}";
+          if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
+          {
+               throw TkError(Tcl_GetStringResult(interp));
+          }
+          
+          Tcl_CreateObjCommand(interp, lazyCommand, lazyHandler, 0, 0);
+          registered = true;
+     }
+     
+     bool waiting = lazyBuilders.count(container) != 0;
+     lazyBuilders[container] = builder;
+     
+     if (!waiting)
+     {
+          std::string script("bindtags ");
+          script += container;
+          script += " [linsert [bindtags ";
+          script += container;
+          script += "] 0 ";
+          script += lazyTag;
+          script += "]; winfo ismapped ";
+          script += container;
+          
+          int mapped;
+          if (Tcl_Eval(interp, script.c_str()) != TCL_OK ||
+               Tcl_GetIntFromObj(interp, Tcl_GetObjResult(interp), &mapped)
+                    != TCL_OK)
+          {
+               lazyBuilders.erase(container);
+               throw TkError(Tcl_GetStringResult(interp));
+          }
+          
+          // the container that is already visible is built immediately
+          if (mapped)
+          {
+               buildNow(container);
+               return;
+          }
+     }
+     
+     if (idle)
+     {
+          if (lazyIdleQueue.empty())
+          {
+               Tcl_DoWhenIdle(lazyIdleProc, 0);
+          }
+          lazyIdleQueue.push_back(container);
+     }
+}
+
+bool Tk::buildNow(std::string const &container)
+{
+     std::function<void ()> builder(takeBuilder(container));
+     if (!builder)
+     {
+          return false;
+     }
+     
+     TraceSpan span(container, "lazy");
+     builder();
+     return true;
+}
+
+bool Tk::lazyPending(std::string const &container)
+{
+     return lazyBuilders.count(container) != 0;
+}
+
+int Tk::watchFd(int fd, int events, FdHandler const &h)
+{
+#ifdef _WIN32
+     throw TkError("Watching file descriptors is not supported");
+#else
+     int mask = 0;
+     if (events & readable)    mask |= TCL_READABLE;
+     if (events & writable)    mask |= TCL_WRITABLE;
+     if (events & exceptional) mask |= TCL_EXCEPTION;
+
+     // make sure that the interpreter (and the notifier) exists
+     getInterp();
+
+     // there can be only one handler for the given descriptor
+     fdHandlers[fd].reset(new FdHandler(h));
+     Tcl_CreateFileHandler(fd, mask, fdHandler,
+          reinterpret_cast<ClientData>(static_cast<size_t>(fd)));
+
+     return fd;
+#endif // _WIN32
+}
+
+void Tk::unwatchFd(int fd)
+{
+#ifndef _WIN32
+     if (fdHandlers.erase(fd) != 0)
+     {
+          Tcl_DeleteFileHandler(fd);
+     }
+#endif // _WIN32
+}
+
+Tk::FdHandle::FdHandle(int fd) : fd_(fd) {}
+
+Tk::FdHandle::~FdHandle() { unwatchFd(fd_); }
+
+Expr Tk::eval(std::string const &str)
+{
+     return Expr(str);
+}
+
+void Tk::init(char *argv0)
+{
+	Tcl_FindExecutable(argv0);
+}
+
+void Tk::runEventLoop()
+{
+     // refresh Tcl variables
+     linkCpptoTcl();
+     
+     Tk_MainLoop();
+}
+
+namespace { // anonymous
+
+// processes at most one event, trying the kinds in the order of
+// their priority; idle handlers are run only if nothing else was pending
+bool processOneEvent(int kinds, EventCounts &counts)
+{
+     if ((kinds & windowEvents) &&
+          Tcl_DoOneEvent(TCL_WINDOW_EVENTS | TCL_DONT_WAIT))
+     {
+          ++counts.window;
+          return true;
+     }
+     if ((kinds & fileEvents) &&
+          Tcl_DoOneEvent(TCL_FILE_EVENTS | TCL_DONT_WAIT))
+     {
+          ++counts.file;
+          return true;
+     }
+     if ((kinds & timerEvents) &&
+          Tcl_DoOneEvent(TCL_TIMER_EVENTS | TCL_DONT_WAIT))
+     {
+          ++counts.timer;
+          return true;
+     }
+     if ((kinds & idleEvents) &&
+          Tcl_DoOneEvent(TCL_IDLE_EVENTS | TCL_DONT_WAIT))
+     {
+          ++counts.idle;
+          return true;
+     }
+     return false;
+}
+
+} // namespace anonymous
+
+EventCounts Tk::processEvents(int budget, int kinds)
+{
+     typedef std::chrono::steady_clock Clock;
+     Clock::time_point deadline =
+          Clock::now() + std::chrono::milliseconds(budget);
+
+     // refresh Tcl variables
+     linkCpptoTcl();
+
+     EventCounts counts;
+     while (processOneEvent(kinds, counts) && Clock::now() < deadline)
+     {
+     }
+     return counts;
+}
+
+EventCounts Tk::processPending(int kinds)
+{
+     // refresh Tcl variables
+     linkCpptoTcl();
+
+     EventCounts counts;
+     while (processOneEvent(kinds, counts))
+     {
+     }
+     return counts;
+}
+
+void Tk::enableShadowState(bool enable)
+{
+     shadowEnabled = enable;
+     if (!enable)
+     {
+          shadowState.clear();
+     }
+}
+
+void Tk::clearShadowState(std::string const &path)
+{
+     if (path.empty())
+     {
+          shadowState.clear();
+     }
+     else
+     {
+          forgetShadow(path);
+     }
+}
+
+ShadowStats Tk::getShadowStats()
+{
+     return shadowStats;
+}
+
+void Tk::resetShadowStats()
+{
+     shadowStats = ShadowStats();
+}
+
+void Tk::enableQueryCache(bool enable)
+{
+     cacheEnabled = enable;
+     if (!enable)
+     {
+          queryCache.clear();
+          unwatchWidgets();
+     }
+}
+
+void Tk::clearQueryCache(std::string const &path)
+{
+     if (path.empty())
+     {
+          queryCache.clear();
+     }
+     else
+     {
+          forgetCached(path);
+     }
+}
+
+QueryCacheStats Tk::getQueryCacheStats()
+{
+     return cacheStats;
+}
+
+void Tk::resetQueryCacheStats()
+{
+     cacheStats = QueryCacheStats();
+}
+
+void Tk::enableProfiler(bool enable)
+{
+     profilerEnabled = enable;
+}
+
+Tk::ProfileScope::ProfileScope(char const *file, int line)
+     : active_(profilerEnabled)
+{
+     if (active_)
+     {
+          sites.push_back(Site(file, line));
+     }
+}
+
+Tk::ProfileScope::~ProfileScope()
+{
+     if (active_)
+     {
+          sites.pop_back();
+     }
+}
+
+namespace { // anonymous
+
+bool longerEntry(ProfileEntry const &a, ProfileEntry const &b)
+{
+     return a.inclusive > b.inclusive;
+}
+
+} // namespace anonymous
+
+std::vector<ProfileEntry> Tk::getProfile()
+{
+     std::vector<ProfileEntry> entries;
+     for (Profile::const_iterator it = profile.begin();
+          it != profile.end(); ++it)
+     {
+          entries.push_back(it->second);
+     }
+     std::sort(entries.begin(), entries.end(), longerEntry);
+     return entries;
+}
+
+void Tk::resetProfile()
+{
+     profile.clear();
+}
+
+void Tk::printProfile(std::ostream &os, std::size_t maxEntries)
+{
+     std::vector<ProfileEntry> entries(getProfile());
+     if (entries.size() > maxEntries)
+     {
+          entries.resize(maxEntries);
+     }
+     
+     os << "inclusive ms  exclusive ms  commands  site\n";
+     for (std::size_t i = 0; i != entries.size(); ++i)
+     {
+          ProfileEntry const &e = entries[i];
+          
+          std::string site(e.file.empty() ? "(no scope)" : e.file);
+          if (e.line != 0)
+          {
+               site += ':';
+               site += std::to_string(e.line);
+          }
+          
+          // the slowest command is shortened to fit in the line
+          std::string slowest(e.slowestCommand.substr(0, 40));
+          if (slowest.size() < e.slowestCommand.size())
+          {
+               slowest += "...";
+          }
+          
+          char line[64];
+          std::snprintf(line, sizeof(line), "%12.3f  %12.3f  %8ld  ",
+               e.inclusive, e.exclusive, e.commands);
+          os << line << site << "\n";
+          
+          std::snprintf(line, sizeof(line), "%.3f", e.slowest);
+          os << "    slowest " << line << " ms: " << slowest << '\n';
+     }
+}
+
+void Tk::startTrace(std::size_t capacity)
+{
+     traceCapacity = capacity;
+     traceEpoch = clockNanoseconds();
+     ++traceGeneration;
+     traceEnabled = true;
+}
+
+void Tk::stopTrace()
+{
+     traceEnabled = false;
+}
+
+bool Tk::tracing()
+{
+     return traceEnabled;
+}
+
+void Tk::writeTrace(std::ostream &os)
+{
+     std::lock_guard<std::mutex> lock(traceMutex);
+     
+     os << "{\"traceEvents\":[";
+     bool first = true;
+     for (std::size_t i = 0; i != traceBuffers.size(); ++i)
+     {
+          TraceBuffer const &b = *traceBuffers[i];
+          if (!b.current())
+          {
+               continue;
+          }
+          
+          os << (first ? "\n" : ",\n");
+          first = false;
+          os << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,"
+               "\"tid\":" << b.tid() << ",\"args\":{\"name\":\"thread "
+             << b.tid() << "\"}}";
+          
+          for (std::size_t j = 0; j != b.size(); ++j)
+          {
+               TraceRecord const &r = b.at(j);
+               os << ",\n{\"name\":";
+               writeJsonString(os, r.name);
+               os << ",\"cat\":\"" << r.category
+                  << "\",\"ph\":\"X\",\"ts\":";
+               writeMicroseconds(os, r.start);
+               os << ",\"dur\":";
+               writeMicroseconds(os, r.duration);
+               os << ",\"pid\":1,\"tid\":" << b.tid();
+               if (r.detail[0] != '\0')
+               {
+                    os << ",\"args\":{\"command\":";
+                    writeJsonString(os, r.detail);
+                    os << '}';
+               }
+               os << '}';
+          }
+     }
+     os << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+Tk::TraceSpan::TraceSpan(std::string const &name, char const *category)
+     : active_(traceEnabled), category_(category), start_(0)
+{
+     if (active_)
+     {
+          name_ = name;
+          start_ = traceNow();
+     }
+}
+
+Tk::TraceSpan::~TraceSpan()
+{
+     if (active_)
+     {
+          traceRecord(category_, name_, start_);
+     }
+}
+
+void Tk::enableWatchdog(double budget, WatchdogHandler const &h,
+     bool sampleStack)
+{
+     disableWatchdog();
+     
+     watchBudget = static_cast<long long>(budget * 1e6);
+     watchdogHandler = h;
+     watchdogEnabled = true;
+     
+#ifdef CPPTK_STACK_SAMPLING
+     if (sampleStack)
+     {
+          struct sigaction sa;
+          std::memset(&sa, 0, sizeof(sa));
+          sa.sa_handler = stackSampler;
+          sa.sa_flags = SA_RESTART;
+          sigemptyset(&sa.sa_mask);
+          if (sigaction(SIGURG, &sa, &previousUrgAction) == 0)
+          {
+               urgActionSaved = true;
+          }
+          
+          // the first call loads the unwinder,
+          // which is not safe in the signal handler
+          void *frame;
+          backtrace(&frame, 1);
+          
+          std::thread(watchdogLoop, watchdogGeneration.load(),
+               pthread_self()).detach();
+     }
+#else
+     (void)sampleStack;
+#endif // CPPTK_STACK_SAMPLING
+}
+
+void Tk::disableWatchdog()
+{
+     watchdogEnabled = false;
+     watchdogHandler = WatchdogHandler();
+#ifdef CPPTK_STACK_SAMPLING
+     ++watchdogGeneration;
+     if (urgActionSaved)
+     {
+          sigaction(SIGURG, &previousUrgAction, NULL);
+          urgActionSaved = false;
+     }
+#endif // CPPTK_STACK_SAMPLING
+}
+
+void Tk::startCommandLog(std::string const &fileName)
+{
+     commandLog.reset();
+     commandLog.reset(new CommandLog(fileName));
+}
+
+void Tk::stopCommandLog()
+{
+     commandLog.reset();
+}
+
+namespace { // anonymous
+
+class LogReader
+{
+public:
+     explicit LogReader(std::string const &fileName)
+          : is_(fileName.c_str(), std::ios::binary), fileName_(fileName)
+     {
+          char header[logHeaderSize];
+          if (!is_.read(header, logHeaderSize) ||
+               std::memcmp(header, logHeader, logHeaderSize) != 0)
+          {
+               throw TkError("Not a command log: " + fileName);
+          }
+     }
+     
+     // reads the next command or callback record (with its time),
+     // returns 0 at the end of the log
+     char next(long long &time, std::vector<std::string> &words)
+     {
+          for (;;)
+          {
+               int type = is_.get();
+               if (type == std::char_traits<char>::eof())
+               {
+                    return 0;
+               }
+               
+               if (type == 'S')
+               {
+                    known_.push_back(getWord());
+                    continue;
+               }
+               if (type != 'E' && type != 'O' && type != 'K')
+               {
+                    corrupted();
+               }
+               
+               time += static_cast<long long>(getNumber());
+               words.resize(static_cast<std::size_t>(getNumber()));
+               for (std::size_t i = 0; i != words.size(); ++i)
+               {
+                    unsigned long long c = getNumber();
+                    if (c == 0)
+                    {
+                         words[i] = getWord();
+                    }
+                    else if (c <= known_.size())
+                    {
+                         words[i] = known_[static_cast<std::size_t>(c - 1)];
+                    }
+                    else
+                    {
+                         corrupted();
+                    }
+               }
+               return static_cast<char>(type);
+          }
+     }
+
+private:
+     std::string getWord()
+     {
+          std::string w(static_cast<std::size_t>(getNumber()), '\0');
+          if (!w.empty() && !is_.read(&w[0],
+               static_cast<std::streamsize>(w.size())))
+          {
+               corrupted();
+          }
+          return w;
+     }
+     
+     unsigned long long getNumber()
+     {
+          unsigned long long n = 0;
+          for (int shift = 0; shift < 64; shift += 7)
+          {
+               int c = is_.get();
+               if (c == std::char_traits<char>::eof())
+               {
+                    break;
+               }
+               n |= static_cast<unsigned long long>(c & 0x7f) << shift;
+               if ((c & 0x80) == 0)
+               {
+                    return n;
+               }
+          }
+          corrupted();
+          return 0;
+     }
+     
+     void corrupted()
+     {
+          throw TkError("The command log is corrupted: " + fileName_);
+     }
+     
+     std::ifstream is_;
+     std::string fileName_;
+     std::vector<std::string> known_;
+};
+
+// the callbacks do not exist in the interpreter that replays the log,
+// so the commands of the CppTk namespace that are not known do nothing
+// - the original unknown is kept aside while the log is replayed
+char const *replayUnknown =
+     "namespace eval ::CppTk {}\n"
+     "if {[info commands ::unknown] ne {}} {\n"
+     "     rename ::unknown ::CppTk::unknown\n"
+     "}\n"
+     "proc ::CppTk::replayed {cmd args} {\n"
+     "     if {[string match CppTk::* $cmd]} return\n"
+     "     if {[info commands ::CppTk::unknown] eq {}} {\n"
+     "          return -code error \"invalid command name \\\"$cmd\\\"\"\n"
+     "     }\n"
+     "     uplevel 1 [list ::CppTk::unknown $cmd {*}$args]\n"
+     "}\n"
+     "interp alias {} ::unknown {} ::CppTk::replayed";
+
+char const *restoreUnknown =
+     "rename ::unknown {}\n"
+     "rename ::CppTk::replayed {}\n"
+     "if {[info commands ::CppTk::unknown] ne {}} {\n"
+     "     rename ::CppTk::unknown ::unknown\n"
+     "}";
+
+// installs the replaying unknown for the scope
+// (the replays nested in the callbacks use the outer one)
+class ReplayUnknown
+{
+public:
+     explicit ReplayUnknown(Tcl_Interp *interp)
+          : interp_(interp), installed_(false)
+     {
+          if (Tcl_Eval(interp_, "info commands ::CppTk::replayed") != TCL_OK)
+          {
+               throw TkError(Tcl_GetStringResult(interp_));
+          }
+          if (*Tcl_GetStringResult(interp_) != '\0')
+          {
+               return;
+          }
+          if (Tcl_Eval(interp_, replayUnknown) != TCL_OK)
+          {
+               throw TkError(Tcl_GetStringResult(interp_));
+          }
+          installed_ = true;
+     }
+     
+     ~ReplayUnknown()
+     {
+          if (installed_)
+          {
+               // the result (also the error) of the replay is kept
+               Tcl_InterpState state = Tcl_SaveInterpState(interp_, TCL_OK);
+               Tcl_Eval(interp_, restoreUnknown);
+               Tcl_RestoreInterpState(interp_, state);
+          }
+     }
+
+private:
+     ReplayUnknown(ReplayUnknown const &);
+     ReplayUnknown & operator=(ReplayUnknown const &);
+     
+     Tcl_Interp *interp_;
+     bool installed_;
+};
+
+// processes the events until the given time
+void processEventsUntil(std::chrono::steady_clock::time_point due)
+{
+     while (std::chrono::steady_clock::now() < due)
+     {
+          if (Tcl_DoOneEvent(TCL_ALL_EVENTS | TCL_DONT_WAIT) == 0)
+          {
+               long ms = static_cast<long>(std::chrono::duration_cast<
+                    std::chrono::milliseconds>(due -
+                         std::chrono::steady_clock::now()).count());
+               Tcl_Sleep(ms < 1 ? 1 : ms > 10 ? 10 : ms);
+          }
+     }
+}
+
+} // namespace anonymous
+
+ReplayStats Tk::replayCommandLog(std::string const &fileName, bool realTime)
+{
+     LogReader reader(fileName);
+     
+     Tcl_Interp *interp = getInterp();
+     ReplayUnknown unknown(interp);
+     
+     ReplayStats stats;
+     std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+     
+     long long time = 0;
+     std::vector<std::string> words;
+     std::vector<Tcl_Obj *> objv;
+     while (char type = reader.next(time, words))
+     {
+          if (type == 'K')
+          {
+               ++stats.callbacks;
+               continue;
+          }
+          
+          if (realTime)
+          {
+               processEventsUntil(start + std::chrono::microseconds(time));
+          }
+          
+          int cc;
+          if (type == 'E')
+          {
+               std::string script;
+               for (std::size_t i = 0; i != words.size(); ++i)
+               {
+                    if (i != 0)
+                    {
+                         script += ' ';
+                    }
+                    script += words[i];
+               }
+               cc = Tcl_Eval(interp, script.c_str());
+          }
+          else
+          {
+               objv.clear();
+               for (std::size_t i = 0; i != words.size(); ++i)
+               {
+                    Tcl_Obj *o = Tcl_NewStringObj(words[i].data(),
+                         static_cast<int>(words[i].size()));
+                    Tcl_IncrRefCount(o);
+                    objv.push_back(o);
+               }
+               cc = objv.empty() ? TCL_OK : Tcl_EvalObjv(interp,
+                    static_cast<int>(objv.size()), &objv[0], 0);
+               for (std::size_t i = 0; i != objv.size(); ++i)
+               {
+                    Tcl_DecrRefCount(objv[i]);
+               }
+          }
+          
+          ++stats.commands;
+          if (cc != TCL_OK)
+          {
+               ++stats.errors;
+          }
      }
+     Tcl_ResetResult(interp);
      
-     return val;
+     stats.duration = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - start).count();
+     return stats;
 }
 
-template <>
-std::string Tk::details::getResultElem<std::string>(int indx)
-{
-     Tcl_Interp *interp = getInterp();
+// input event recording
 
-     Tcl_Obj *list = Tcl_GetObjResult(interp);
-     Tcl_Obj *obj;
-     
-     int cc = Tcl_ListObjIndex(interp, list, indx, &obj);
-     if (cc != TCL_OK)
-     {
-          throw TkError(Tcl_GetStringResult(interp));
-     }
-     
-     return Tcl_GetString(obj);
-}
+namespace { // anonymous
 
-details::Command::Command(std::string const &str, std::string const &postfix)
-     : invoked_(false), str_(str), postfix_(postfix)
-{
-}
+// the binding tag is put first in the bindtags of each widget that gets
+// an input event, so that the event is recorded before the other
+// bindings (which can end with break) run
+char const *inputCommand = "CppTk::input";
+char const *inputTag = "CppTk::input";
 
-details::Command::~Command()
+char const *inputTypes[] = { "ButtonPress", "ButtonRelease", "Motion",
+     "KeyPress", "KeyRelease", "MouseWheel" };
+
+bool inputRecording = false;
+std::chrono::steady_clock::time_point inputStart;
+std::vector<InputEvent> inputEvents;
+
+// the widgets that have the tag
+std::set<std::string> inputTagged;
+
+// the time of the event being delivered, taken before its handlers run
+double inputTime = 0.0;
+
+int intOrZero(Tcl_Obj *o)
 {
-     if (!TkError::inTkError)
-     {
-          invokeOnce();
-     }
+     int i;
+     return Tcl_GetIntFromObj(NULL, o, &i) == TCL_OK ? i : 0;
 }
 
-std::string Tk::details::Command::invoke() const
+// the script bound to the tag
+std::string inputScript(char const *type)
 {
-     invokeOnce();
-     return Tcl_GetStringResult(getInterp());
+     std::string script(inputCommand);
+     script += ' ';
+     script += type;
+     script += " %W %x %y %b %s %D %K";
+     return script;
 }
 
-void Tk::details::Command::invokeOnce() const
+extern "C"
+int inputHandler(ClientData, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[])
 {
-     if (invoked_ == false)
+     // the destroyed widget has to get the tag again if it is recreated
+     if (objc == 3)
      {
-          invoked_ = true;
-          
-          std::string cmd(str_);
-          cmd += postfix_;
-          
-          do_eval(cmd);
+          inputTagged.erase(Tcl_GetString(objv[2]));
+          return TCL_OK;
      }
-}
-
-details::Expr::Expr(std::string const &str, bool starter)
-{
-     if (starter)
+     
+     if (!inputRecording || objc != 9)
      {
-          cmd_.reset(new Command(str));
+          return TCL_OK;
      }
-     else
+     
+     InputEvent e;
+     e.time = inputTime;
+     e.type = Tcl_GetString(objv[1]);
+     e.widget = Tcl_GetString(objv[2]);
+     e.x = intOrZero(objv[3]);
+     e.y = intOrZero(objv[4]);
+     e.button = intOrZero(objv[5]);
+     e.state = intOrZero(objv[6]);
+     e.delta = intOrZero(objv[7]);
+     e.keysym = Tcl_GetString(objv[8]);
+     if (e.keysym == "??")
      {
-          str_ = str;
+          e.keysym.clear();
      }
+     inputEvents.push_back(e);
+     return TCL_OK;
 }
 
-details::Expr::Expr(std::string const &str, std::string const &postfix)
-{
-     cmd_.reset(new Command(str, postfix));
-}
-
-std::string Tk::details::Expr::getValue() const
+// puts the tag first in the bindtags of the widget
+void tagInputWidget(Tcl_Interp *interp, std::string const &path)
 {
-     if (!str_.empty())
+     if (path.empty() || !inputTagged.insert(path).second)
      {
-          return str_;
+          return;
      }
-     else
+     
+     // the tag may be already there, if the widget was tagged
+     // by the previous recording
+     std::string script("bindtags ");
+     script += path;
+     script += " [linsert [lsearch -all -inline -not -exact [bindtags ";
+     script += path;
+     script += "] ";
+     script += inputTag;
+     script += "] 0 ";
+     script += inputTag;
+     script += ']';
+     if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
      {
-          return cmd_->getValue();
+          inputTagged.erase(path);
      }
 }
 
-details::Expr::operator std::string() const
-{
-     return cmd_->invoke();
-}
-
-details::Expr::operator int() const
+// sees each event before Tk delivers it to the bindings - the widgets
+// that get the input events are tagged on the fly (also those created
+// during the recording) and the time is taken here
+extern "C"
+int inputEventHandler(ClientData clientData, XEvent *eventPtr)
 {
-     cmd_->invokeOnce();
+     int type = eventPtr->type;
+     bool key = type == KeyPress || type == KeyRelease;
+     if (!key && type != ButtonPress && type != ButtonRelease &&
+          type != MotionNotify && type != MouseWheelEvent)
+     {
+          return 0;
+     }
      
-     Tcl_Interp *interp = getInterp();
-     Tcl_Obj *obj = Tcl_GetObjResult(interp);
-
-     int val, cc;
-     cc = Tcl_GetIntFromObj(interp, obj, &val);
-     if (cc != TCL_OK)
+     inputTime = std::chrono::duration<double, std::milli>(
+          std::chrono::steady_clock::now() - inputStart).count();
+     
+     Tcl_Interp *interp = static_cast<Tcl_Interp *>(clientData);
+     Tcl_InterpState state = Tcl_SaveInterpState(interp, TCL_OK);
+     
+     Tk_Window w = Tk_IdToWindow(eventPtr->xany.display,
+          eventPtr->xany.window);
+     if (w != NULL && Tk_PathName(w) != NULL)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          tagInputWidget(interp, Tk_PathName(w));
      }
      
-     return val;
+     // the key events are delivered to the focus window
+     if (key && Tcl_Eval(interp, "focus") == TCL_OK)
+     {
+          tagInputWidget(interp, Tcl_GetStringResult(interp));
+     }
+     
+     Tcl_RestoreInterpState(interp, state);
+     return 0;
 }
 
-details::Expr::operator double() const
+} // namespace anonymous
+
+void Tk::startInputRecording()
 {
-     cmd_->invokeOnce();
-     
      Tcl_Interp *interp = getInterp();
-     Tcl_Obj *obj = Tcl_GetObjResult(interp);
-     
-     double val;
-     int cc = Tcl_GetDoubleFromObj(interp, obj, &val);
-     if (cc != TCL_OK)
+     if (!inputRecording)
      {
-          throw TkError(Tcl_GetStringResult(interp));
+          Tcl_CreateObjCommand(interp, inputCommand, inputHandler, 0, 0);
+          for (std::size_t i = 0; i != sizeof(inputTypes) / sizeof(char *);
+               ++i)
+          {
+               std::string script("bind ");
+               script += inputTag;
+               script += " <";
+               script += inputTypes[i];
+               script += "> {";
+               script += inputScript(inputTypes[i]);
+               script += '}';
+               if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
+               {
+                    throw TkError(Tcl_GetStringResult(interp));
+               }
+          }
+          
+          std::string script("bind ");
+          script += inputTag;
+          script += " <Destroy> {";
+          script += inputCommand;
+          script += " Destroy %W}";
+          if (Tcl_Eval(interp, script.c_str()) != TCL_OK)
+          {
+               throw TkError(Tcl_GetStringResult(interp));
+          }
+          
+          Tk_CreateGenericHandler(inputEventHandler, interp);
      }
      
-     return val;
+     inputEvents.clear();
+     inputStart = std::chrono::steady_clock::now();
+     inputRecording = true;
 }
 
-details::Expr::operator Tk::Point() const
+std::vector<InputEvent> Tk::stopInputRecording()
 {
-     std::string ret(cmd_->invoke());
-     if (ret.empty())
+     std::vector<InputEvent> events;
+     if (!inputRecording)
      {
-          return Tk::Point(0, 0);
+          return events;
      }
-
-     int len = getResultLen();
-     if (len < 2)
+     inputRecording = false;
+     
+     Tcl_Interp *interp = getInterp();
+     Tk_DeleteGenericHandler(inputEventHandler, interp);
+     
+     // the tag is taken out of the widgets that still exist
+     // and its bindings are deleted
+     for (std::set<std::string>::const_iterator it = inputTagged.begin();
+          it != inputTagged.end(); ++it)
      {
-          throw TkError("Cannot convert the result list to Point\n");
+          std::string script("if {[winfo exists ");
+          script += *it;
+          script += "]} {bindtags ";
+          script += *it;
+          script += " [lsearch -all -inline -not -exact [bindtags ";
+          script += *it;
+          script += "] ";
+          script += inputTag;
+          script += "]}";
+          Tcl_Eval(interp, script.c_str());
      }
+     inputTagged.clear();
      
-     int x = getResultElem<int>(0);
-     int y = getResultElem<int>(1);
+     std::string script("foreach s [bind ");
+     script += inputTag;
+     script += "] {bind ";
+     script += inputTag;
+     script += " $s {}}";
+     Tcl_Eval(interp, script.c_str());
+     Tcl_ResetResult(interp);
+     Tcl_DeleteCommand(interp, inputCommand);
      
-     return Point(x, y);
+     events.swap(inputEvents);
+     return events;
 }
 
-details::Expr::operator Tk::Box() const
+void Tk::saveInputEvents(std::string const &fileName,
+     std::vector<InputEvent> const &events)
 {
-     std::string ret(cmd_->invoke());
-     if (ret.empty())
+     std::ofstream os(fileName.c_str());
+     if (!os)
      {
-          return Tk::Box(0, 0, 0, 0);
+          throw TkError("Cannot write the input events to " + fileName);
      }
      
-     int len = getResultLen();
-     if (len < 4)
+     os << "cpptk-input 1\n";
+     os.setf(std::ios::fixed);
+     os.precision(3);
+     for (std::size_t i = 0; i != events.size(); ++i)
      {
-          throw TkError("Cannot convert the result list to Box\n");
+          InputEvent const &e = events[i];
+          os << e.time << '\t' << e.type << '\t' << e.widget << '\t'
+             << e.x << '\t' << e.y << '\t' << e.button << '\t'
+             << e.state << '\t' << e.delta << '\t' << e.keysym << '\n';
      }
      
-     int x1 = getResultElem<int>(0);
-     int y1 = getResultElem<int>(1);
-     int x2 = getResultElem<int>(2);
-     int y2 = getResultElem<int>(3);
-     
-     return Box(x1, y1, x2, y2);
+     if (!os)
+     {
+          throw TkError("Cannot write the input events to " + fileName);
+     }
 }
 
-// these two specializations are used to extract parameter
-// with the requested type
-
-template <>
-int Tk::details::Params::get<int>(int argno) const
+std::vector<InputEvent> Tk::loadInputEvents(std::string const &fileName)
 {
-     if (argno < 1 || argno >= argc_)
+     std::ifstream is(fileName.c_str());
+     std::string line;
+     if (!std::getline(is, line) || line != "cpptk-input 1")
      {
-          throw TkError("Parameter number out of valid range");
+          throw TkError("Not an input event file: " + fileName);
      }
      
-     Tcl_Obj *CONST *objv = reinterpret_cast<Tcl_Obj *CONST *>(objv_);
-     
-     int res, cc;
-     cc = Tcl_GetIntFromObj(getInterp(), objv[argno], &res);
-     if (cc != TCL_OK)
+     std::vector<InputEvent> events;
+     while (std::getline(is, line))
      {
-          throw TkError(Tcl_GetStringResult(getInterp()));
+          std::istringstream ss(line);
+          std::string field[9];
+          for (int i = 0; i != 9; ++i)
+          {
+               // the keysym in the last field can be empty
+               if (!std::getline(ss, field[i], '\t') && i != 8)
+               {
+                    throw TkError("Malformed input event in " + fileName +
+                         ": " + line);
+               }
+          }
+          
+          InputEvent e;
+          e.time = std::atof(field[0].c_str());
+          e.type = field[1];
+          e.widget = field[2];
+          e.x = std::atoi(field[3].c_str());
+          e.y = std::atoi(field[4].c_str());
+          e.button = std::atoi(field[5].c_str());
+          e.state = std::atoi(field[6].c_str());
+          e.delta = std::atoi(field[7].c_str());
+          e.keysym = field[8];
+          events.push_back(e);
      }
-     
-     return res;
+     return events;
 }
 
-template <>
-std::string Tk::details::Params::get<std::string>(int argno) const
+InputReplayStats Tk::replayInputEvents(std::vector<InputEvent> const &events,
+     double speed)
 {
-     if (argno < 1 || argno >= argc_)
+     Tcl_Interp *interp = getInterp();
+     
+     InputReplayStats stats;
+     double total = 0.0;
+     std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+     
+     for (std::size_t i = 0; i != events.size(); ++i)
      {
-          throw TkError("Parameter number out of valid range");
+          InputEvent const &e = events[i];
+          if (speed > 0)
+          {
+               processEventsUntil(start + std::chrono::microseconds(
+                    static_cast<long long>(e.time * 1000 / speed)));
+          }
+          
+          std::vector<std::string> words;
+          words.push_back("event");
+          words.push_back("generate");
+          words.push_back(e.widget);
+          words.push_back("<" + e.type + ">");
+          if (e.type == "KeyPress" || e.type == "KeyRelease")
+          {
+               words.push_back("-keysym");
+               words.push_back(e.keysym);
+          }
+          else
+          {
+               if (e.type == "ButtonPress" || e.type == "ButtonRelease")
+               {
+                    words.push_back("-button");
+                    words.push_back(std::to_string(e.button));
+               }
+               else if (e.type == "MouseWheel")
+               {
+                    words.push_back("-delta");
+                    words.push_back(std::to_string(e.delta));
+               }
+               words.push_back("-x");
+               words.push_back(std::to_string(e.x));
+               words.push_back("-y");
+               words.push_back(std::to_string(e.y));
+          }
+          words.push_back("-state");
+          words.push_back(std::to_string(e.state));
+          
+          std::vector<Tcl_Obj *> objv;
+          for (std::size_t j = 0; j != words.size(); ++j)
+          {
+               Tcl_Obj *o = Tcl_NewStringObj(words[j].data(),
+                    static_cast<int>(words[j].size()));
+               Tcl_IncrRefCount(o);
+               objv.push_back(o);
+          }
+          
+          // the key events go to the focus window
+          if (!e.keysym.empty())
+          {
+               std::string focus("focus ");
+               focus += e.widget;
+               Tcl_Eval(interp, focus.c_str());
+          }
+          
+          std::chrono::steady_clock::time_point generated =
+               std::chrono::steady_clock::now();
+          int cc = Tcl_EvalObjv(interp, static_cast<int>(objv.size()),
+               &objv[0], 0);
+          runIdlePass();
+          double latency = std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - generated).count();
+          
+          for (std::size_t j = 0; j != objv.size(); ++j)
+          {
+               Tcl_DecrRefCount(objv[j]);
+          }
+          
+          ++stats.events;
+          if (cc != TCL_OK)
+          {
+               ++stats.failed;
+               stats.latencies.push_back(0.0);
+               continue;
+          }
+          
+          stats.latencies.push_back(latency);
+          total += latency;
+          if (latency > stats.maxLatency)
+          {
+               stats.maxLatency = latency;
+          }
      }
+     Tcl_ResetResult(interp);
      
-     Tcl_Obj *CONST *objv = reinterpret_cast<Tcl_Obj *CONST *>(objv_);
-     
-     std::string res = Tcl_GetString(objv[argno]);
-     return res;
+     if (stats.events != stats.failed)
+     {
+          stats.meanLatency = total / (stats.events - stats.failed);
+     }
+     return stats;
 }
 
-std::ostream & Tk::details::operator<<(std::ostream &os, BasicToken const &token)
+void Tk::startSnapshot()
 {
-     return os << static_cast<std::string>(token);
+     snapshotScript.clear();
+     snapshotCapturing = true;
 }
 
 namespace { // anonymous
 
-void doSingleQuote(std::string &s, char c)
+// the names that are different in each run of the program
+bool unstableName(std::string const &script, std::string &name)
 {
-     std::string::size_type pos = 0;
-     while ((pos = s.find(c, pos)) != std::string::npos)
+     char const *prefixes[] = { callbackPrefix, linkVarPrefix,
+          dispatchCommand };
+     for (std::size_t i = 0; i != sizeof(prefixes) / sizeof(char *); ++i)
      {
-          s.insert(pos, "\\");
-          pos += 2;
+          std::string::size_type pos = script.find(prefixes[i]);
+          while (pos != std::string::npos)
+          {
+               std::string::size_type end = pos + std::strlen(prefixes[i]);
+               if (end < script.size() &&
+                    (std::isdigit(static_cast<unsigned char>(script[end])) ||
+                         script[end] == ' '))
+               {
+                    name = script.substr(pos,
+                         script.find_first_of(" \n}]", end + 1) - pos);
+                    return true;
+               }
+               pos = script.find(prefixes[i], end);
+          }
      }
+     return false;
 }
 
 } // namespace anonymous
 
-// this function is used to quote quotation marks in string values'
-// in later version, it will not be needed
-std::string Tk::details::quote(std::string const &s)
+std::string Tk::stopSnapshot()
 {
-     std::string ret(s);
-     doSingleQuote(ret, '\\');
-     doSingleQuote(ret, '\"');
-     doSingleQuote(ret, '$');
-     doSingleQuote(ret, '[');
-     doSingleQuote(ret, ']');
+     snapshotCapturing = false;
      
-     return ret;
-}
-
-// basic Tk expression operations
-
-Expr Tk::operator-(Expr const &lhs, Expr const &rhs)
-{
-     std::shared_ptr<Command> cmd(lhs.getCmd());
-     cmd->append(rhs.getValue());
+     std::string script;
+     script.swap(snapshotScript);
      
-     return Expr(cmd);
+     std::string name;
+     if (unstableName(script, name))
+     {
+          throw TkError("The snapshot refers to " + name +
+               ", which does not have a stable name");
+     }
+     return script;
 }
 
-Expr Tk::operator<<(std::string const &w, Expr const &rhs)
+void Tk::saveSnapshot(std::string const &fileName, std::string const &script)
 {
-     std::shared_ptr<Command> cmd(rhs.getCmd());
-     cmd->prepend(" ");
-     cmd->prepend(w);
-
-     return Expr(cmd);
+     std::ofstream os(fileName.c_str(), std::ios::binary);
+     os << snapshotHeader << script;
+     if (!os)
+     {
+          throw TkError("Cannot write the snapshot to " + fileName);
+     }
 }
 
-// helper functions
-
-void Tk::deleteCallback(std::string const &name)
+bool Tk::loadSnapshot(std::string const &fileName)
 {
-     std::string::size_type pos = name.find_first_not_of(callbackPrefix);
-     if (pos == std::string::npos) return;
+     std::ifstream is(fileName.c_str(), std::ios::binary);
+     if (!is)
+     {
+          return false;
+     }
      
-     int slot = std::stoi(name.substr(pos, name.size()));
-     callbacks.erase(slot);
+     std::ostringstream ss;
+     ss << is.rdbuf();
+     std::string script(ss.str());
+     if (script.compare(0, std::strlen(snapshotHeader), snapshotHeader) != 0)
+     {
+          throw TkError("Not a snapshot: " + fileName);
+     }
      
-     int cc = Tcl_DeleteCommand(getInterp(), name.c_str());
+     // the whole script is compiled once and evaluated in one step
+     Tcl_Obj *obj = Tcl_NewStringObj(script.data(),
+          static_cast<int>(script.size()));
+     Tcl_IncrRefCount(obj);
+     int cc = Tcl_EvalObjEx(getInterp(), obj, TCL_EVAL_GLOBAL);
+     Tcl_DecrRefCount(obj);
      if (cc != TCL_OK)
      {
           throw TkError(Tcl_GetStringResult(getInterp()));
      }
-}
-
-Tk::CallbackHandle::CallbackHandle(std::string const &name) : name_(name) {}
-
-Tk::CallbackHandle::~CallbackHandle() { deleteCallback(name_); }
-
-Expr Tk::eval(std::string const &str)
-{
-     return Expr(str);
-}
-
-void Tk::init(char *argv0)
-{
-	Tcl_FindExecutable(argv0);
-}
-
-void Tk::runEventLoop()
-{
-     // refresh Tcl variables
-     linkCpptoTcl();
      
-     Tk_MainLoop();
+     // refresh C++ variables
+     linkTcltoCpp();
+     return true;
 }
 
 void Tk::setDumpStream(std::ostream &os)
@@ -22,9 +22,13 @@
 #include <utility>
 #include <sstream>
 #include <vector>
+#include <functional>
+#include <chrono>
+#include <map>
 #include <memory>
 #include <boost/lexical_cast.hpp>
 #include <iosfwd>
+#include <cstddef>
 
 namespace Tk
 {
@@ -34,18 +38,11 @@ namespace Tk
 class TkError : public std::runtime_error
 {
 public:
-     explicit TkError(std::string const &msg)
-          : std::runtime_error(msg)
-     {
-          inTkError = true;
-     }
-
-     ~TkError() throw()
-     {
-          inTkError = false;
-     }
+     explicit TkError(std::string const &msg);
+     ~TkError() throw();
 
-     static bool inTkError;
+     // true while the error propagates in the current thread
+     static bool inTkError();
 };
 
 // for functions returning point and box (or windows) coordinates
@@ -150,6 +147,31 @@ struct CallbackTraits<R (*)(T1, T2, T3, T4, T5, T6, T7, T8, T9, T10)>
 namespace details
 {
 
+// The ObjRef class keeps a counted reference to a Tcl object.
+// The object is kept as an opaque pointer to isolate this header
+// from Tcl/Tk headers.
+
+class ObjRef
+{
+public:
+     ObjRef() : obj_(NULL) {}
+     explicit ObjRef(void *obj);
+     ObjRef(ObjRef const &other);
+     ~ObjRef();
+     
+     ObjRef & operator=(ObjRef const &other);
+     
+     void * get() const { return obj_; }
+
+private:
+     void *obj_;
+};
+
+// helpers for building lists of numbers without formatting them as text
+ObjRef makeList(double const *xy, std::size_t n);
+ObjRef makeList(Point const *p, std::size_t n);
+ObjRef makeObj(std::string const &s);
+
 // The Command class gathers everything on its road while
 // it travels the Tk expression
 // It executes the command when destroyed, which is at the end
@@ -164,16 +186,32 @@ public:
      
      std::string invoke() const;
      void append(std::string const &str) { str_ += str; }
-     void prepend(std::string const &str) { str_.insert(0, str); }
+     void prepend(std::string const &str);
      std::string getValue() const { return str_; }
      
-     void invokeOnce() const;
+     // appends a single word that is passed to Tcl as a ready object
+     void appendObj(ObjRef const &obj);
+     
+     // puts a ready object as the first word (the command name)
+     void prependObj(ObjRef const &obj);
+     
+     // returns false if the evaluation failed
+     // (possible only when the errors are not thrown);
+     // the later calls return the outcome of the first one
+     bool invokeOnce() const;
 
 private:
      
+     bool evaluate() const;
+     
+     // object words, together with their positions in the command string
+     typedef std::vector<std::pair<std::string::size_type, ObjRef> > ObjWords;
+     
      mutable bool invoked_;
+     mutable bool ok_;
      std::string str_;
      std::string postfix_;
+     ObjWords objs_;
 };
 
 // returns the length of the result list
@@ -262,6 +300,9 @@ public:
      Params(int argc, void *objv) : argc_(argc), objv_(objv) {}
      
      template <typename T> T get(int argno) const;
+     
+     // number of parameters, including the callback name
+     int getArgc() const { return argc_; }
 
 private:
      int argc_;
@@ -270,6 +311,7 @@ private:
 
 // available specializations for Params::get
 template <> int         Params::get<int>(int argno) const;
+template <> double      Params::get<double>(int argno) const;
 template <> std::string Params::get<std::string>(int argno) const;
 
 
@@ -283,7 +325,24 @@ public:
      virtual void invoke(Params const &) = 0;
 };
 
-std::string addCallback(std::shared_ptr<CallbackBase> cb);
+// the callback is owned by the widget it is first given to
+// and deleted together with it (or when another callback is set
+// for the same option or binding), unless the owned flag is false
+// (then it lives until it is deleted explicitly)
+std::string addCallback(std::shared_ptr<CallbackBase> cb,
+     bool owned = true);
+
+// the callback with the stable name (it replaces the previous callback
+// with the same name and lives until it is deleted explicitly)
+std::string addNamedCallback(std::string const &name,
+     std::shared_ptr<CallbackBase> cb);
+
+// the callback name as a single word
+// (the names of dispatched callbacks consist of two words)
+inline std::string callbackWord(std::string const &name)
+{
+     return name.find(' ') == std::string::npos ? name : "{" + name + "}";
+}
 
 // helpers for setting result in the interpreter
 void setResult(bool b);
@@ -808,6 +867,28 @@ private:
      Functor f_;
 };
 
+// The MemberCallback is used by library components that
+// need to see the raw list of parameters (for example, when
+// the number of parameters given by Tk can vary)
+
+template <class T>
+class MemberCallback : public CallbackBase
+{
+public:
+     typedef void (T::*Handler)(Params const &);
+     
+     MemberCallback(T *obj, Handler h) : obj_(obj), h_(h) {}
+     
+     virtual void invoke(Params const &p)
+     {
+          (obj_->*h_)(p);
+     }
+
+private:
+     T *obj_;
+     Handler h_;
+};
+
 std::string addLinkVar(int &i);
 std::string addLinkVar(double &d);
 std::string addLinkVar(std::string &s);
@@ -908,13 +989,234 @@ details::Expr operator<<(std::string const &w, details::Expr const &rhs);
 template <class Functor> std::string callback(Functor f)
 {
      return details::addCallback(
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback0<Functor>(f)), false);
+}
+
+// for defining callbacks with stable names (CppTk::named::name),
+// which are the same in each run of the program
+template <class Functor>
+std::string callback(std::string const &name, Functor f)
+{
+     return details::addNamedCallback(name,
           std::shared_ptr<details::CallbackBase>(
                new details::Callback0<Functor>(f)));
 }
 
+// the named callbacks that get the event or validation attributes give
+// the name followed by the substitutions, ready to be bound, for example:
+// CallbackHandle h(callback("click", onClick, event_x, event_y));
+// bind(".c", "<Button-1>", h);
+template <class Functor, typename T1>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback1<Functor, T1>(f))));
+     script += ' ';  script += a1.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback2<Functor, T1, T2>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback3<Functor, T1, T2, T3>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback4<Functor, T1, T2, T3, T4>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback5<Functor, T1, T2, T3, T4, T5>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5, typename T6>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5, details::SubstAttr<T6> const &a6)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback6<Functor, T1, T2, T3, T4, T5, T6>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     script += ' ';  script += a6.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5, typename T6, typename T7>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5, details::SubstAttr<T6> const &a6,
+     details::SubstAttr<T7> const &a7)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback7<Functor,
+                    T1, T2, T3, T4, T5, T6, T7>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     script += ' ';  script += a6.get();
+     script += ' ';  script += a7.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5, typename T6, typename T7, typename T8>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5, details::SubstAttr<T6> const &a6,
+     details::SubstAttr<T7> const &a7, details::SubstAttr<T8> const &a8)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback8<Functor,
+                    T1, T2, T3, T4, T5, T6, T7, T8>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     script += ' ';  script += a6.get();
+     script += ' ';  script += a7.get();
+     script += ' ';  script += a8.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5, typename T6, typename T7, typename T8, typename T9>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5, details::SubstAttr<T6> const &a6,
+     details::SubstAttr<T7> const &a7, details::SubstAttr<T8> const &a8,
+     details::SubstAttr<T9> const &a9)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback9<Functor,
+                    T1, T2, T3, T4, T5, T6, T7, T8, T9>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     script += ' ';  script += a6.get();
+     script += ' ';  script += a7.get();
+     script += ' ';  script += a8.get();
+     script += ' ';  script += a9.get();
+     return script;
+}
+
+template <class Functor, typename T1, typename T2, typename T3, typename T4,
+     typename T5, typename T6, typename T7, typename T8, typename T9,
+     typename T10>
+std::string callback(std::string const &name, Functor f,
+     details::SubstAttr<T1> const &a1, details::SubstAttr<T2> const &a2,
+     details::SubstAttr<T3> const &a3, details::SubstAttr<T4> const &a4,
+     details::SubstAttr<T5> const &a5, details::SubstAttr<T6> const &a6,
+     details::SubstAttr<T7> const &a7, details::SubstAttr<T8> const &a8,
+     details::SubstAttr<T9> const &a9, details::SubstAttr<T10> const &a10)
+{
+     std::string script(details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::Callback10<Functor,
+                    T1, T2, T3, T4, T5, T6, T7, T8, T9, T10>(f))));
+     script += ' ';  script += a1.get();
+     script += ' ';  script += a2.get();
+     script += ' ';  script += a3.get();
+     script += ' ';  script += a4.get();
+     script += ' ';  script += a5.get();
+     script += ' ';  script += a6.get();
+     script += ' ';  script += a7.get();
+     script += ' ';  script += a8.get();
+     script += ' ';  script += a9.get();
+     script += ' ';  script += a10.get();
+     return script;
+}
+
+// the named callbacks of the components that see the raw parameters
+template <class T>
+std::string callback(std::string const &name, T *obj,
+     void (T::*h)(details::Params const &))
+{
+     return details::addNamedCallback(name,
+          std::shared_ptr<details::CallbackBase>(
+               new details::MemberCallback<T>(obj, h)));
+}
+
 // for deleting callbacks
 void deleteCallback(std::string const &name);
 
+// the number of callbacks that currently exist
+std::size_t liveCallbacks();
+
+// the callbacks registered from now on are invoked through the single
+// Tcl command CppTk::dispatch, with the slot number and its generation
+// as the first arguments, instead of having a separate Tcl command each
+// (their names are like "CppTk::dispatch 5 0");
+// the slots of deleted callbacks are reused with the next generation,
+// so that the old names fail instead of invoking the new callbacks
+void enableCallbackDispatch(bool enable = true);
+
 // RAII handle for callback (calls deleteCallback in its destructor)
 class CallbackHandle
 {
@@ -928,6 +1230,128 @@ private:
      std::string name_;
 };
 
+// for reacting to the readiness of file descriptors (pipes, sockets, etc.)
+// in the event loop, without polling (not available on Windows)
+
+enum FdEvent { readable = 1, writable = 2, exceptional = 4 };
+
+// the handler gets the combination of events that have happened
+typedef std::function<void (int)> FdHandler;
+
+// replaces the previous handler for the same descriptor (if any)
+// and returns the descriptor
+int watchFd(int fd, int events, FdHandler const &h);
+void unwatchFd(int fd);
+
+// RAII handle for watching (calls unwatchFd in its destructor)
+class FdHandle
+{
+public:
+     explicit FdHandle(int fd);
+     ~FdHandle();
+     
+     int get() const { return fd_; }
+     
+private:
+     FdHandle(FdHandle const &);
+     FdHandle & operator=(FdHandle const &);
+     
+     int fd_;
+};
+
+// for running C++ functions after the given time (in milliseconds);
+// all such timers are kept in a timer wheel that uses a single Tcl timer,
+// so that there can be thousands of them
+
+// returns the identifier of the new timer
+long setTimeout(int delay, std::function<void ()> const &f);
+long setInterval(int interval, std::function<void ()> const &f);
+
+// the timer can be cleared also by its own function
+void clearTimer(long id);
+bool timerActive(long id);
+
+// RAII handle for timers (calls clearTimer in its destructor)
+class TimerHandle
+{
+public:
+     explicit TimerHandle(long id);
+     ~TimerHandle();
+     
+     long get() const { return id_; }
+     
+private:
+     TimerHandle(TimerHandle const &);
+     TimerHandle & operator=(TimerHandle const &);
+     
+     long id_;
+};
+
+// for pacing redraws - the requested tasks are run together,
+// at most fps times per second, and the tasks requested
+// with the same key before the frame are run only once
+
+class FrameScheduler
+{
+public:
+     typedef std::function<void ()> Task;
+     
+     explicit FrameScheduler(int fps = 60);
+     ~FrameScheduler();
+     
+     void setFps(int fps);
+     int getFps() const { return fps_; }
+     
+     // the last task requested with the given key wins
+     void request(std::string const &key, Task const &t);
+     void cancel(std::string const &key);
+     
+     // runs the pending tasks immediately
+     // (normally called by the scheduler's timer)
+     void runFrame();
+     
+     // frame times are in milliseconds and include one pass
+     // of the idle handlers (the redraws done by Tk) after the tasks
+     long frames() const { return frames_; }
+     double lastFrameTime() const { return lastTime_; }
+     double averageFrameTime() const;
+     double maxFrameTime() const { return maxTime_; }
+     void resetStats();
+     
+private:
+     FrameScheduler(FrameScheduler const &);
+     FrameScheduler & operator=(FrameScheduler const &);
+     
+     typedef std::chrono::steady_clock Clock;
+     
+     int fps_;
+     std::vector<std::pair<std::string, Task> > tasks_;
+     std::map<std::string, std::size_t> index_;
+     void *timer_;
+     Clock::time_point lastFrame_;
+     
+     long frames_;
+     double lastTime_;
+     double totalTime_;
+     double maxTime_;
+};
+
+// for deferred construction of widget subtrees - the builder creates
+// the children of the existing container the first time the container
+// is mapped (for example, when its tab is selected or its dialog
+// is shown), when buildNow is called or, if idle is true, when Tk
+// has nothing else to do (one builder in each idle pass)
+
+void buildLazily(std::string const &container,
+     std::function<void ()> const &builder, bool idle = false);
+
+// builds the subtree immediately; returns false if there was
+// no builder waiting for the container
+bool buildNow(std::string const &container);
+
+// tells whether the builder of the container is still waiting
+bool lazyPending(std::string const &container);
+
 // for linking variable
 template <typename T> std::string linkVar(T &t)
 {
@@ -955,12 +1379,375 @@ private:
 // for brute-force evaluation of simple scripts
 details::Expr eval(std::string const &str);
 
+// The Result class is returned by the try_ functions below - it holds
+// either the value or the error message and the error code (the value
+// of Tcl's -errorcode, like "TK LOOKUP WINDOW .b").
+
+template <typename T>
+class Result
+{
+public:
+     explicit Result(T const &value) : value_(value), ok_(true) {}
+     Result(std::string const &error, std::string const &code)
+          : value_(), ok_(false), error_(error), code_(code) {}
+     
+     bool ok() const { return ok_; }
+     explicit operator bool() const { return ok_; }
+     
+     // throws TkError if there is no value
+     T const & value() const
+     {
+          if (!ok_)
+          {
+               throw TkError(error_);
+          }
+          return value_;
+     }
+     
+     T valueOr(T const &other) const { return ok_ ? value_ : other; }
+     
+     std::string const & error() const { return error_; }
+     std::string const & errorCode() const { return code_; }
+     
+private:
+     T value_;
+     bool ok_;
+     std::string error_;
+     std::string code_;
+};
+
+// evaluate the expression (if it was not evaluated yet) and convert its
+// result without throwing exceptions (the mode is per thread, as is the
+// TkError::inTkError() flag), for example:
+// Result<bool> r = try_<bool>(winfo(exists, ".b"));
+template <typename T> Result<T> try_(details::Expr const &e);
+
+// available specializations
+template <> Result<std::string> try_<std::string>(details::Expr const &e);
+template <> Result<int>         try_<int>(details::Expr const &e);
+template <> Result<double>      try_<double>(details::Expr const &e);
+template <> Result<bool>        try_<bool>(details::Expr const &e);
+
+inline Result<std::string> try_(details::Expr const &e)
+{
+     return try_<std::string>(e);
+}
+
 // for initializing Tcl environment
 void init(char *argv0);
 
 // for falling into the event loop
 void runEventLoop();
 
+// for processing events step by step, from the application's own loop
+
+// kinds of events (can be combined)
+enum EventKind
+{
+     windowEvents = 1, fileEvents = 2, timerEvents = 4, idleEvents = 8,
+     allEvents = windowEvents | fileEvents | timerEvents | idleEvents
+};
+
+// numbers of processed events of each kind
+// (all idle handlers that were pending at once count as one)
+struct EventCounts
+{
+     EventCounts() : window(0), file(0), timer(0), idle(0) {}
+
+     int total() const { return window + file + timer + idle; }
+
+     int window;
+     int file;
+     int timer;
+     int idle;
+};
+
+// processes the pending events of the given kinds until there are
+// no more of them or until the budget (in milliseconds) is used up;
+// never waits for new events
+EventCounts processEvents(int budget, int kinds = allEvents);
+
+// processes the pending events of the given kinds until there are
+// no more of them (like the "update" command)
+EventCounts processPending(int kinds = allEvents);
+
+// for skipping the configure and itemconfigure writes of values that
+// are already set - the last values written through the library are
+// remembered for each widget and canvas item, under the option names
+// resolved by Tk (so that -bg and -background are the same option);
+// the values are forgotten when the widget is created or destroyed and
+// when tk_setPalette is called; the widgets configured by Tcl code
+// outside the library (like Tcl scripts or option database changes)
+// need clearShadowState, since the widget commands are not traced
+void enableShadowState(bool enable = true);
+
+// forgets the remembered values of the widget (and its children),
+// or of all widgets
+void clearShadowState(std::string const &path = std::string());
+
+struct ShadowStats
+{
+     ShadowStats() : writes(0), suppressed(0), skipped(0) {}
+     
+     long writes;         // option values written
+     long suppressed;     // values that were already set
+     long skipped;        // commands that were not evaluated at all
+};
+
+ShadowStats getShadowStats();
+void resetShadowStats();
+
+// enables (or disables) the cache of query results - the results of
+// cget and of winfo width, height, x, y and class are kept in C++ and
+// served without evaluating the query again;
+// the geometry is forgotten when the widget gets the Configure event
+// (the binding tag CppTk::cache is put in front of its tags, until the
+// cache is disabled) and the
+// options are forgotten when they are changed through the library
+// (this assumes that they are not changed by other means, like Tcl
+// scripts or -textvariable)
+void enableQueryCache(bool enable = true);
+
+// forgets the cached results for the widget (and its children),
+// or for all widgets
+void clearQueryCache(std::string const &path = std::string());
+
+struct QueryCacheStats
+{
+     QueryCacheStats() : hits(0), misses(0) {}
+     
+     long hits;           // queries served from the cache
+     long misses;         // queries that had to be evaluated
+};
+
+QueryCacheStats getQueryCacheStats();
+void resetQueryCacheStats();
+
+// call-site profiler - the Tcl commands are attributed to the innermost
+// ProfileScope that exists when they are evaluated (or to the callback
+// that evaluates them, if there is no scope inside the callback)
+
+// the location of the caller, where supported by the compiler
+#if defined(__GNUC__) || defined(__clang__) || \
+     (defined(_MSC_VER) && _MSC_VER >= 1926)
+#define CPPTK_CALLER_FILE __builtin_FILE()
+#define CPPTK_CALLER_LINE __builtin_LINE()
+#else
+#define CPPTK_CALLER_FILE "unknown"
+#define CPPTK_CALLER_LINE 0
+#endif
+
+void enableProfiler(bool enable = true);
+
+class ProfileScope
+{
+public:
+     // the defaults are the place where the scope is created
+     explicit ProfileScope(char const *file = CPPTK_CALLER_FILE,
+          int line = CPPTK_CALLER_LINE);
+     ~ProfileScope();
+
+private:
+     ProfileScope(ProfileScope const &);
+     ProfileScope & operator=(ProfileScope const &);
+     
+     bool active_;
+};
+
+struct ProfileEntry
+{
+     ProfileEntry() : line(0), commands(0), inclusive(0.0), exclusive(0.0),
+          slowest(0.0) {}
+     
+     // the place of the scope (or the name of the callback and 0,
+     // or an empty name for commands evaluated outside of any scope)
+     std::string file;
+     int line;
+     
+     long commands;               // Tcl commands evaluated
+     double inclusive;            // their time in milliseconds
+     double exclusive;            // the same without the nested callbacks
+     double slowest;              // the longest of the commands
+     std::string slowestCommand;
+};
+
+// the entries are sorted by the inclusive time, the longest first
+std::vector<ProfileEntry> getProfile();
+void resetProfile();
+
+// prints the longest entries as a table
+void printProfile(std::ostream &os, std::size_t maxEntries = 20);
+
+// timeline tracing - the command evaluations, callbacks, variable
+// synchronization, timers, frames and file handlers are recorded as
+// spans (each thread has its own ring buffer, so that the recording
+// does not need any locks) and can be exported in the Chrome
+// trace-event format, for chrome://tracing or Perfetto
+
+// starts recording and discards the previous spans; each thread keeps
+// at most capacity spans, the oldest ones are overwritten (the ring is
+// reserved up front and the names and commands are copied into it,
+// cut to 47 and 127 characters, so that recording does not allocate)
+void startTrace(std::size_t capacity = 65536);
+void stopTrace();
+bool tracing();
+
+// writes the recorded spans as JSON (this should be done when the
+// other threads do not record their own spans)
+void writeTrace(std::ostream &os);
+
+// records the application's own span, from the construction
+// to the destruction of the object
+class TraceSpan
+{
+public:
+     explicit TraceSpan(std::string const &name,
+          char const *category = "app");
+     ~TraceSpan();
+
+private:
+     TraceSpan(TraceSpan const &);
+     TraceSpan & operator=(TraceSpan const &);
+     
+     bool active_;
+     std::string name_;
+     char const *category_;
+     long long start_;
+};
+
+// slow-callback watchdog - the callbacks, timers (setTimeout and
+// setInterval), frames of FrameScheduler and file handlers that block
+// the GUI thread for longer than the budget are reported to the handler
+// (after they return)
+
+struct SlowCall
+{
+     SlowCall() : duration(0.0) {}
+     
+     std::string kind;    // "callback", "timer", "frame" or "fd"
+     std::string name;    // the Tcl command of the callback
+     std::string type;    // the C++ type of the function, if known
+     double duration;     // in milliseconds
+     
+     // the stack of the GUI thread sampled while the budget was exceeded
+     // (empty if not requested or not supported)
+     std::vector<std::string> stack;
+};
+
+typedef std::function<void (SlowCall const &)> WatchdogHandler;
+
+// the budget is given in milliseconds; the default handler prints the
+// report to std::cerr; with sampleStack a watchdog thread interrupts
+// the GUI thread with a signal to capture its stack when the budget is
+// exceeded (supported only with glibc - the sleeps and waits that are
+// interrupted by the signal can return early); this has to be called
+// from the GUI thread
+// the signal is SIGURG - while the stack is sampled the library installs
+// its own handler for it, and disableWatchdog (also called by the next
+// enableWatchdog) restores the application's previous action
+void enableWatchdog(double budget = 50.0,
+     WatchdogHandler const &h = WatchdogHandler(), bool sampleStack = false);
+void disableWatchdog();
+
+// binary command log - the evaluated commands and the invoked callbacks
+// are written to the file with their times; the words (up to 64 bytes)
+// are written only once and then referred to by number
+
+// starts recording to the given file (the previous log is closed)
+void startCommandLog(std::string const &fileName);
+void stopCommandLog();
+
+struct ReplayStats
+{
+     ReplayStats() : commands(0), callbacks(0), errors(0), duration(0.0) {}
+     
+     long commands;       // commands evaluated
+     long callbacks;      // recorded callback invocations
+     long errors;         // commands that failed
+     double duration;     // in milliseconds
+};
+
+// evaluates the commands from the log (the callbacks are not invoked,
+// the commands that they evaluated are in the log); with realTime the
+// original pace is kept (while waiting the events are processed),
+// otherwise the commands are evaluated as fast as possible; the Tcl
+// unknown command is replaced only for the time of the replay
+ReplayStats replayCommandLog(std::string const &fileName,
+     bool realTime = false);
+
+// input event recording - the mouse and keyboard events are recorded
+// with their times (taken before their bindings run), so that the same
+// interaction can be replayed with "event generate" (also on a virtual
+// display, like Xvfb); each widget that gets an input event during the
+// recording has the binding tag "CppTk::input" put first in its
+// bindtags, so the bindings that end with break do not hide the event
+
+struct InputEvent
+{
+     InputEvent() : time(0.0), x(0), y(0), button(0), state(0), delta(0) {}
+     
+     double time;         // milliseconds since the start of the recording
+     std::string type;    // ButtonPress, ButtonRelease, Motion,
+                          // KeyPress, KeyRelease or MouseWheel
+     std::string widget;
+     int x;
+     int y;
+     int button;          // 0 if not a button event
+     int state;           // the modifier mask
+     int delta;           // for MouseWheel
+     std::string keysym;  // empty if not a key event
+};
+
+void startInputRecording();
+std::vector<InputEvent> stopInputRecording();
+
+// the events are kept in a text file, one event per line
+void saveInputEvents(std::string const &fileName,
+     std::vector<InputEvent> const &events);
+std::vector<InputEvent> loadInputEvents(std::string const &fileName);
+
+struct InputReplayStats
+{
+     InputReplayStats() : events(0), failed(0), meanLatency(0.0),
+          maxLatency(0.0) {}
+     
+     long events;         // events generated
+     long failed;         // events that could not be generated
+                          // (for example, the widget did not exist)
+     double meanLatency;  // in milliseconds
+     double maxLatency;
+     
+     // the latency of each event (0 for those that failed)
+     std::vector<double> latencies;
+};
+
+// generates the events at the recorded pace multiplied by speed
+// (0 means as fast as possible); the latency of the event is the time
+// from its generation until its bindings and one pass of the idle work
+// caused by them (like redraws) are finished
+InputReplayStats replayInputEvents(std::vector<InputEvent> const &events,
+     double speed = 1.0);
+
+// UI snapshots - the commands evaluated while the UI is being built
+// can be captured as a single script, which the later runs load and
+// evaluate in one compiled evaluation instead of building the UI again;
+// the script can refer only to the callbacks with stable names
+// (which have to be defined also before the snapshot is loaded),
+// not to other callbacks and linked variables
+
+// starts capturing the successfully evaluated commands
+// (except those evaluated by the callbacks)
+void startSnapshot();
+
+// stops capturing and gives the script; throws TkError if the script
+// refers to the callbacks or variables that do not have stable names
+std::string stopSnapshot();
+
+void saveSnapshot(std::string const &fileName, std::string const &script);
+
+// evaluates the saved snapshot; returns false if there is no such file
+bool loadSnapshot(std::string const &fileName);
+
 // for setting command output stream
 void setDumpStream(std::ostream &os);
 
@@ -0,0 +1,39 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+#ifndef CPPTKINTERP_H_INCLUDED
+#define CPPTKINTERP_H_INCLUDED
+
+// This header is shared by the library sources only and is not
+// installed, since (unlike cpptkbase.h) it depends on Tcl/Tk headers.
+
+#include <tcl.h>
+#include <tk.h>
+#include <exception>
+
+namespace Tk
+{
+namespace details
+{
+
+// lazy-initialization of Tcl interpreter
+Tcl_Interp * getInterp();
+
+// synchronization of linked variables, to be done around
+// the invocation of C++ code from the event loop
+void linkCpptoTcl();
+void linkTcltoCpp();
+
+// reports errors from handlers that have no script to return them to
+void backgroundError(std::exception const &e);
+
+} // namespace details
+} // namespace Tk
+
+#endif // CPPTKINTERP_H_INCLUDED
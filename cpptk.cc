@@ -9,7 +9,9 @@
 //
 
 #include "cpptk.h"
+#include "base/cpptkinterp.h"
 #include <iomanip>
+#include <algorithm>
 
 using namespace Tk;
 using namespace Tk::details;
@@ -481,6 +483,34 @@ Expr Tk::coords(std::string const &item, Box const &b)
      return coords(item, b.x1, b.y1, b.x2, b.y2);
 }
 
+Expr Tk::coords(std::string const &item, double const *xy, std::size_t n)
+{
+     if (n == 0)
+     {
+          throw TkError("A non-empty list of coordinates expected");
+     }
+     
+     std::string str("coords ");
+     str += item;
+     std::shared_ptr<Command> cmd(new Command(str));
+     cmd->appendObj(makeList(xy, n));
+     return Expr(cmd);
+}
+
+Expr Tk::coords(std::string const &item, Point const *p, std::size_t n)
+{
+     if (n == 0)
+     {
+          throw TkError("A non-empty list of coordinates expected");
+     }
+     
+     std::string str("coords ");
+     str += item;
+     std::shared_ptr<Command> cmd(new Command(str));
+     cmd->appendObj(makeList(p, n));
+     return Expr(cmd);
+}
+
 Expr Tk::copy(std::string const &photo)
 {
      std::string str("copy ");
@@ -1021,6 +1051,13 @@ Expr Tk::textvariable(std::string const &name)
      return Expr(str, false);
 }
 
+Expr Tk::validatecommand(CallbackHandle const &handle)
+{
+     std::string str(" -validatecommand { ");
+     str += handle.get(); str += " }";
+     return Expr(str, false);
+}
+
 Expr Tk::variable(std::string const &name)
 {
      std::string str(" -variable ");
@@ -1115,6 +1152,16 @@ Expr Tk::details::BindToken::operator()(std::string const &name,
      return Expr(str);
 }
 
+Expr Tk::details::BindToken::operator()(std::string const &name,
+     std::string const &seq, CallbackHandle const &handle) const
+{
+     std::string str("bind ");
+     str += name;   str += " ";
+     str += seq;    str += " { ";
+     str += handle.get(); str += " }";
+     return Expr(str);
+}
+
 BindToken Tk::bind;
 
 Tk::details::CheckButtonToken::CheckButtonToken()
@@ -1331,6 +1378,36 @@ Expr Tk::details::CreateToken::operator()(std::string const &type,
      return create(type, b.x1, b.y1, b.x2, b.y2);
 }
 
+Expr Tk::details::CreateToken::operator()(std::string const &type,
+     double const *xy, std::size_t n) const
+{
+     if (n == 0)
+     {
+          throw TkError("A non-empty list of coordinates expected");
+     }
+     
+     std::string str("create ");
+     str += type;
+     std::shared_ptr<Command> cmd(new Command(str));
+     cmd->appendObj(makeList(xy, n));
+     return Expr(cmd);
+}
+
+Expr Tk::details::CreateToken::operator()(std::string const &type,
+     Point const *p, std::size_t n) const
+{
+     if (n == 0)
+     {
+          throw TkError("A non-empty list of coordinates expected");
+     }
+     
+     std::string str("create ");
+     str += type;
+     std::shared_ptr<Command> cmd(new Command(str));
+     cmd->appendObj(makeList(p, n));
+     return Expr(cmd);
+}
+
 CreateToken Tk::create;
 
 Tk::details::FocusToken::FocusToken() : BasicToken("focus") {}
@@ -1676,3 +1753,308 @@ std::string Tk::details::RGBToken::operator()(int r, int g, int b) const
 
 RGBToken Tk::rgb;
 
+// photo images
+
+namespace { // anonymous
+
+Tk_PhotoHandle findPhoto(std::string const &name)
+{
+     Tk_PhotoHandle handle = Tk_FindPhoto(getInterp(), name.c_str());
+     if (handle == NULL)
+     {
+          std::string msg("image \"");
+          msg += name;
+          msg += "\" doesn't exist or is not a photo image";
+          throw TkError(msg);
+     }
+     
+     return handle;
+}
+
+void setLayout(Tk_PhotoImageBlock &block, PhotoImage::Format format)
+{
+     switch (format)
+     {
+     case PhotoImage::RGB:
+          block.pixelSize = 3;
+          block.offset[0] = 0; block.offset[1] = 1; block.offset[2] = 2;
+          block.offset[3] = 3; // no alpha channel
+          break;
+     case PhotoImage::BGR:
+          block.pixelSize = 3;
+          block.offset[0] = 2; block.offset[1] = 1; block.offset[2] = 0;
+          block.offset[3] = 3; // no alpha channel
+          break;
+     case PhotoImage::RGBA:
+          block.pixelSize = 4;
+          block.offset[0] = 0; block.offset[1] = 1; block.offset[2] = 2;
+          block.offset[3] = 3;
+          break;
+     case PhotoImage::BGRA:
+          block.pixelSize = 4;
+          block.offset[0] = 2; block.offset[1] = 1; block.offset[2] = 0;
+          block.offset[3] = 3;
+          break;
+     }
+}
+
+} // namespace anonymous
+
+void Tk::PhotoImage::put(unsigned char const *pixels, int width, int height,
+     int pitch, Format format, int x, int y, bool blend) const
+{
+     Tk_PhotoImageBlock block;
+     block.pixelPtr = const_cast<unsigned char *>(pixels);
+     block.width = width;
+     block.height = height;
+     block.pitch = pitch;
+     setLayout(block, format);
+     
+     int cc = Tk_PhotoPutBlock(getInterp(), findPhoto(name_), &block,
+          x, y, width, height,
+          blend ? TK_PHOTO_COMPOSITE_OVERLAY : TK_PHOTO_COMPOSITE_SET);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+}
+
+void Tk::PhotoImage::put(unsigned char const *pixels, int width, int height,
+     int pitch, Format format, Box const &region, bool blend) const
+{
+     // clip the region to the frame
+     int x1 = std::max(region.x1, 0);
+     int y1 = std::max(region.y1, 0);
+     int x2 = std::min(region.x2, width);
+     int y2 = std::min(region.y2, height);
+     if (x1 >= x2 || y1 >= y2)
+     {
+          return;
+     }
+     
+     Tk_PhotoImageBlock block;
+     setLayout(block, format);
+     block.pixelPtr = const_cast<unsigned char *>(pixels)
+          + y1 * pitch + x1 * block.pixelSize;
+     block.width = x2 - x1;
+     block.height = y2 - y1;
+     block.pitch = pitch;
+     
+     int cc = Tk_PhotoPutBlock(getInterp(), findPhoto(name_), &block,
+          x1, y1, block.width, block.height,
+          blend ? TK_PHOTO_COMPOSITE_OVERLAY : TK_PHOTO_COMPOSITE_SET);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+}
+
+void Tk::PhotoImage::setSize(int width, int height) const
+{
+     int cc = Tk_PhotoSetSize(getInterp(), findPhoto(name_), width, height);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+}
+
+void Tk::PhotoImage::blank() const
+{
+     Tk_PhotoBlank(findPhoto(name_));
+}
+
+PixelView Tk::PhotoImage::view() const
+{
+     Tk_PhotoImageBlock block;
+     Tk_PhotoGetImage(findPhoto(name_), &block);
+     
+     PixelView v;
+     v.pixels = block.pixelPtr;
+     v.width = block.width;
+     v.height = block.height;
+     v.pitch = block.pitch;
+     v.pixelSize = block.pixelSize;
+     std::copy(block.offset, block.offset + 4, v.offset);
+     return v;
+}
+
+void Tk::PhotoImage::copyTo(unsigned char *dest, int pitch,
+     Format format) const
+{
+     PixelView v(view());
+     copyTo(dest, pitch, format, Box(0, 0, v.width, v.height));
+}
+
+void Tk::PhotoImage::copyTo(unsigned char *dest, int pitch, Format format,
+     Box const &region) const
+{
+     PixelView v(view());
+     
+     // clip the region to the image
+     int x1 = std::max(region.x1, 0);
+     int y1 = std::max(region.y1, 0);
+     int x2 = std::min(region.x2, v.width);
+     int y2 = std::min(region.y2, v.height);
+     if (x1 >= x2 || y1 >= y2)
+     {
+          return;
+     }
+     
+     Tk_PhotoImageBlock layout;
+     setLayout(layout, format);
+     bool alpha = layout.pixelSize == 4;
+     
+     for (int y = y1; y != y2; ++y)
+     {
+          unsigned char const *src = v.pixel(x1, y);
+          unsigned char *dst = dest + (y - y1) * pitch;
+          for (int x = x1; x != x2; ++x)
+          {
+               dst[layout.offset[0]] = src[v.offset[0]];
+               dst[layout.offset[1]] = src[v.offset[1]];
+               dst[layout.offset[2]] = src[v.offset[2]];
+               if (alpha)
+               {
+                    dst[layout.offset[3]] = src[v.offset[3]];
+               }
+               src += v.pixelSize;
+               dst += layout.pixelSize;
+          }
+     }
+}
+
+// widget handles
+
+Tk::Widget::Widget(std::string const &path)
+     : path_(path), cmd_(makeObj(path))
+{
+}
+
+Expr Tk::Widget::configure() const
+{
+     return *this << Tk::configure();
+}
+
+Expr Tk::Widget::cget(std::string const &name) const
+{
+     return *this << Tk::cget(name);
+}
+
+bool Tk::Widget::exists() const
+{
+     return static_cast<int>(winfo(Tk::exists, path_)) != 0;
+}
+
+Expr Tk::operator<<(Widget const &w, Expr const &rhs)
+{
+     // the cached object becomes the command word
+     std::shared_ptr<Command> cmd(rhs.getCmd());
+     cmd->prependObj(w.cmd_);
+     return Expr(cmd);
+}
+
+// batched layout
+
+Tk::LayoutBatch::LayoutBatch(std::string const &manager,
+     std::string const &container, bool suspendPropagation)
+     : manager_(manager), container_(container),
+       suspend_(suspendPropagation && manager != "place")
+{
+     if (manager != "pack" && manager != "grid" && manager != "place")
+     {
+          throw TkError("Unknown geometry manager: " + manager);
+     }
+}
+
+Tk::LayoutBatch::~LayoutBatch()
+{
+     // the destructor cannot throw, so the errors are reported
+     // in the same way as errors in callbacks
+     try
+     {
+          commit();
+     }
+     catch (std::exception const &e)
+     {
+          backgroundError(e);
+     }
+}
+
+Tk::LayoutBatch::Item & Tk::LayoutBatch::Item::operator-(
+     Expr const &option)
+{
+     std::string const value(option.getValue());
+     for (std::size_t i = first_; i != last_; ++i)
+     {
+          batch_.items_[i].second += value;
+     }
+     return *this;
+}
+
+Tk::LayoutBatch::Item Tk::LayoutBatch::add(std::string const &widget)
+{
+     items_.push_back(std::make_pair(widget, std::string()));
+     return Item(*this, items_.size() - 1, items_.size());
+}
+
+std::string Tk::LayoutBatch::script() const
+{
+     std::string s;
+     for (std::size_t i = 0; i != items_.size(); ++i)
+     {
+          std::string const &options = items_[i].second;
+          
+          // one pack command can manage many widgets, unless they
+          // are positioned relative to each other with -after or -before
+          bool const merge = i != 0 && manager_ == "pack" &&
+               options == items_[i - 1].second &&
+               options.find(" -after ") == std::string::npos &&
+               options.find(" -before ") == std::string::npos;
+          if (!merge)
+          {
+               if (i != 0)
+               {
+                    s += items_[i - 1].second;
+                    s += '\n';
+               }
+               s += manager_;
+          }
+          s += ' ';
+          s += items_[i].first;
+     }
+     s += items_.back().second;
+     return s;
+}
+
+void Tk::LayoutBatch::commit()
+{
+     if (items_.empty())
+     {
+          return;
+     }
+     
+     std::string const body(script());
+     items_.clear();
+     
+     if (!suspend_)
+     {
+          static_cast<std::string>(eval(body));
+          return;
+     }
+     
+     // the container does not follow the requested sizes
+     // of its widgets until all of them are managed
+     std::string const propagate(manager_ + " propagate " + container_);
+     std::string const previous(eval(propagate));
+     static_cast<std::string>(eval(propagate + " 0"));
+     try
+     {
+          static_cast<std::string>(eval(body));
+     }
+     catch (...)
+     {
+          static_cast<std::string>(eval(propagate + " " + previous));
+          throw;
+     }
+     static_cast<std::string>(eval(propagate + " " + previous));
+}
@@ -13,6 +13,10 @@
 
 #include "base/cpptkbase.h"
 
+#if __cplusplus >= 202002L
+#include <span>
+#endif
+
 
 namespace Tk
 {
@@ -385,6 +389,26 @@ details::Expr coords(std::string const &item,
      return details::Expr(cmd);
 }
 
+// these are passed to Tcl as a list of numbers, without formatting
+details::Expr coords(std::string const &item,
+     double const *xy, std::size_t n);
+details::Expr coords(std::string const &item,
+     Point const *p, std::size_t n);
+
+#if __cplusplus >= 202002L
+inline details::Expr coords(std::string const &item,
+     std::span<const double> xy)
+{
+     return coords(item, xy.data(), xy.size());
+}
+
+inline details::Expr coords(std::string const &item,
+     std::span<const Point> p)
+{
+     return coords(item, p.data(), p.size());
+}
+#endif
+
 details::Expr copy(std::string const &photo);
 
 details::Expr curselection();
@@ -1213,6 +1237,14 @@ details::Expr yposition(T const &index)
 }
 
 details::Expr yview();
+
+template <typename T>
+details::Expr yview(T const &t)
+{
+     std::string str("yview ");
+     str += details::toString(t);
+     return details::Expr(str);
+}
 details::Expr yview(std::string const &option, double fraction);
 details::Expr yview(std::string const option,
      int number, std::string const &what);
@@ -1263,7 +1295,7 @@ template <class Functor> details::Expr invalidcommand(Functor f)
                new details::Callback0<Functor>(f)));
      
      std::string str(" -invalidcommand ");
-     str += newCmd;
+     str += details::callbackWord(newCmd);
      return details::Expr(str, false);
 }
 
@@ -1280,7 +1312,7 @@ template <class Functor> details::Expr postcommand(Functor f)
                new details::Callback0<Functor>(f)));
      
      std::string str(" -postcommand ");
-     str += newCmd;
+     str += details::callbackWord(newCmd);
      return details::Expr(str, false);
 }
 
@@ -1342,7 +1374,7 @@ template <class Functor> details::Expr tearoffcommand(Functor f)
                new details::Callback0<Functor>(f)));
      
      std::string str(" -tearoffcommand ");
-     str += newCmd;
+     str += details::callbackWord(newCmd);
      return details::Expr(str, false);
 }
 
@@ -1361,6 +1393,9 @@ details::Expr textvariable(T &t)
 
 details::Expr textvariable(std::string const &name);
 
+class CallbackHandle;
+details::Expr validatecommand(CallbackHandle const &handle);
+
 template <class Functor>
 details::Expr validatecommand(Functor f)
 {
@@ -1369,7 +1404,7 @@ details::Expr validatecommand(Functor f)
                new details::Callback0<Functor>(f)));
      
      std::string str(" -validatecommand ");
-     str += newCmd;
+     str += details::callbackWord(newCmd);
      return details::Expr(str, false);
 }
 
@@ -1654,6 +1689,10 @@ public:
      
      Expr operator()(std::string const &name,
           std::string const &seq) const;
+     
+     // binds the named callback (with its substitutions)
+     Expr operator()(std::string const &name,
+          std::string const &seq, CallbackHandle const &handle) const;
 
      template <class Functor>
      details::Expr operator()(std::string const &name,
@@ -2136,6 +2175,26 @@ public:
      
           return Expr(cmd);
      }
+
+     // these are passed to Tcl as a list of numbers, without formatting
+     Expr operator()(std::string const &type,
+          double const *xy, std::size_t n) const;
+     Expr operator()(std::string const &type,
+          Point const *p, std::size_t n) const;
+
+#if __cplusplus >= 202002L
+     Expr operator()(std::string const &type,
+          std::span<const double> xy) const
+     {
+          return (*this)(type, xy.data(), xy.size());
+     }
+
+     Expr operator()(std::string const &type,
+          std::span<const Point> p) const
+     {
+          return (*this)(type, p.data(), p.size());
+     }
+#endif
 };
 
 class FocusToken : public BasicToken
@@ -2249,7 +2308,7 @@ public:
                     new Callback0<Functor>(f)));
      
           std::string str(" -command ");
-          str += newCmd;
+          str += callbackWord(newCmd);
           return Expr(str, false);
      }
 
@@ -2428,6 +2487,188 @@ std::string txt(T1 const &t1, T2 const &t2)
      return str;
 }
 
+// direct access to the pixels of photo images
+// (the pixels are transferred with Tk C API,
+// without formatting them as "#rrggbb" strings)
+
+// read-only view of the pixels stored by the photo image
+// it is valid only until the image is next modified or deleted
+struct PixelView
+{
+     unsigned char const *pixels;
+     int width, height;
+     int pitch;       // distance (in bytes) between rows
+     int pixelSize;   // distance (in bytes) between pixels in a row
+     int offset[4];   // offsets of red, green, blue and alpha in a pixel
+     
+     unsigned char const * row(int y) const { return pixels + y * pitch; }
+     unsigned char const * pixel(int x, int y) const
+     { return row(y) + x * pixelSize; }
+};
+
+class PhotoImage
+{
+public:
+     // layouts of pixels in the memory
+     enum Format { RGB, BGR, RGBA, BGRA };
+     
+     explicit PhotoImage(std::string const &name) : name_(name) {}
+     
+     std::string const & get() const { return name_; }
+     
+     // writes the whole frame of pixels into the image at (x, y)
+     // pitch is the distance (in bytes) between the rows of the frame
+     // when blend is false, the pixels (with alpha) replace the old ones
+     void put(unsigned char const *pixels, int width, int height,
+          int pitch, Format format, int x = 0, int y = 0,
+          bool blend = false) const;
+     
+     // writes only the given region of the frame,
+     // at the same position in the image (for partial updates)
+     void put(unsigned char const *pixels, int width, int height,
+          int pitch, Format format, Box const &region,
+          bool blend = false) const;
+     
+     // sets the size of the image (0 means that the image can grow)
+     void setSize(int width, int height) const;
+     
+     // clears the image
+     void blank() const;
+     
+     // gives access to the pixels without copying them
+     PixelView view() const;
+     
+     // copies the pixels into the caller's buffer
+     // (the buffer has to be big enough for the whole image)
+     void copyTo(unsigned char *dest, int pitch, Format format) const;
+     
+     // copies only the given region of the image
+     // (its top left corner lands at the beginning of the buffer)
+     void copyTo(unsigned char *dest, int pitch, Format format,
+          Box const &region) const;
+
+private:
+     std::string name_;
+};
+
+// The Widget class is a handle for an existing widget.
+// It keeps the widget path together with the ready Tcl object for
+// the widget command, so that the widget commands are evaluated
+// word by word, without concatenating the path and looking up
+// the command each time. Only the command word is cached - the rest
+// of the command (the subcommand and its options) is still built as
+// text and split into words on each call, except the words that are
+// already objects (like numeric canvas coordinates).
+// All widget commands can be used with it:
+//
+//     Widget c(canvas(".c"));
+//     c << create(line, 10, 10, 20, 20);
+//     c.configure() -background("white");
+
+class Widget;
+
+details::Expr operator<<(Widget const &w, details::Expr const &rhs);
+
+class Widget
+{
+public:
+     explicit Widget(std::string const &path);
+     
+     std::string const & path() const { return path_; }
+     operator std::string() const { return path_; }
+     
+     details::Expr configure() const;
+     details::Expr cget(std::string const &name) const;
+     
+     bool exists() const;
+
+private:
+     friend details::Expr operator<<(Widget const &w,
+          details::Expr const &rhs);
+     
+     std::string path_;
+     details::ObjRef cmd_;
+};
+
+// The LayoutBatch class lays out many widgets in one container at once.
+// The widgets are collected together with their options and managed
+// by a single script, evaluated in one step; the consecutive widgets
+// with the same options share one pack command (grid and place
+// get one command per widget, as grid would put them in one row).
+// Unless told otherwise, the geometry propagation of the container
+// is suspended until the whole batch is managed, so that its size
+// is computed only once:
+//
+//     LayoutBatch batch("grid", ".form");
+//     for (int i = 0; i != n; ++i)
+//     {
+//          batch.add(labels[i]) -row(i) -column(0) -sticky("e");
+//          batch.add(entries[i]) -row(i) -column(1);
+//     }
+//     batch.commit();
+//
+// A range of widgets can be added with common options:
+//
+//     batch.add(buttons.begin(), buttons.end()) -side(left) -padx(2);
+//
+// The pending widgets are also managed when the batch is destroyed.
+
+class LayoutBatch
+{
+public:
+     // the manager is "pack", "grid" or "place"
+     LayoutBatch(std::string const &manager, std::string const &container,
+          bool suspendPropagation = true);
+     ~LayoutBatch();
+     
+     // collects the options of the added widgets
+     class Item
+     {
+     public:
+          Item(LayoutBatch &batch, std::size_t first, std::size_t last)
+               : batch_(batch), first_(first), last_(last) {}
+          
+          Item & operator-(details::Expr const &option);
+          
+     private:
+          LayoutBatch &batch_;
+          std::size_t first_, last_;
+     };
+     
+     Item add(std::string const &widget);
+     
+     // adds the range of widgets (paths or Widget handles),
+     // which get the same options
+     template <class InputIterator>
+     Item add(InputIterator first, InputIterator last)
+     {
+          std::size_t begin = items_.size();
+          for (; first != last; ++first)
+          {
+               add(std::string(*first));
+          }
+          return Item(*this, begin, items_.size());
+     }
+     
+     std::size_t pending() const { return items_.size(); }
+     
+     // manages the pending widgets
+     void commit();
+     
+private:
+     LayoutBatch(LayoutBatch const &);
+     LayoutBatch & operator=(LayoutBatch const &);
+     
+     std::string script() const;
+     
+     std::string manager_;
+     std::string container_;
+     bool suspend_;
+     
+     // widget paths with their options
+     std::vector<std::pair<std::string, std::string> > items_;
+};
+
 } // namespace Tk
 
 #endif // CPPTK_H_INCLUDED
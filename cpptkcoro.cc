@@ -0,0 +1,420 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+#include "cpptkcoro.h"
+#include "base/cpptkinterp.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+using namespace Tk;
+using namespace Tk::details;
+
+namespace { // anonymous
+
+// resumes the coroutine from the event loop
+// (the waiter can be destroyed by the coroutine)
+void resumeWaiter(Waiter &w)
+{
+     TraceSpan span("resume", "coroutine");
+
+     // refresh C++ variables
+     linkTcltoCpp();
+
+     w.resume(w.handle);
+
+     // refresh Tcl variables
+     linkCpptoTcl();
+}
+
+// evaluates the command given as separate words (without quoting)
+int evalWords(std::string const *words, int n)
+{
+     std::vector<Tcl_Obj *> objv;
+     for (int i = 0; i != n; ++i)
+     {
+          Tcl_Obj *o = Tcl_NewStringObj(words[i].data(),
+               static_cast<int>(words[i].size()));
+          Tcl_IncrRefCount(o);
+          objv.push_back(o);
+     }
+
+     int cc = Tcl_EvalObjv(getInterp(), n, &objv[0], 0);
+
+     for (int i = 0; i != n; ++i)
+     {
+          Tcl_DecrRefCount(objv[i]);
+     }
+     return cc;
+}
+
+int intOrZero(Tcl_Obj *o)
+{
+     int i;
+     return Tcl_GetIntFromObj(0, o, &i) == TCL_OK ? i : 0;
+}
+
+int waitId = 0;
+
+char const *waitTagPrefix = "CppTk::wait";
+char const *resumeCommand = "CppTk::resume";
+
+} // namespace anonymous
+
+// timers and idle handlers
+
+extern "C"
+void waiterProc(ClientData cd)
+{
+     Waiter *w = static_cast<Waiter *>(cd);
+     w->token = 0;
+     resumeWaiter(*w);
+}
+
+void Tk::details::startTimer(Waiter &w, int ms)
+{
+     w.token = Tcl_CreateTimerHandler(ms > 0 ? ms : 0, waiterProc,
+          static_cast<ClientData>(&w));
+}
+
+void Tk::details::stopTimer(Waiter &w)
+{
+     if (w.token != 0)
+     {
+          Tcl_DeleteTimerHandler(static_cast<Tcl_TimerToken>(w.token));
+          w.token = 0;
+     }
+}
+
+void Tk::details::startIdle(Waiter &w)
+{
+     Tcl_DoWhenIdle(waiterProc, static_cast<ClientData>(&w));
+     w.token = &w;
+}
+
+void Tk::details::stopIdle(Waiter &w)
+{
+     if (w.token != 0)
+     {
+          Tcl_CancelIdleCall(waiterProc, static_cast<ClientData>(&w));
+          w.token = 0;
+     }
+}
+
+// events - each waiter has its own binding tag,
+// which is put in front of the widget's binding tags
+
+extern "C"
+int resumeHandler(ClientData, Tcl_Interp *interp,
+     int objc, Tcl_Obj *CONST objv[])
+{
+     Tcl_WideInt addr;
+     if (objc < 2 ||
+          Tcl_GetWideIntFromObj(interp, objv[1], &addr) != TCL_OK)
+     {
+          return TCL_ERROR;
+     }
+
+     EventWaiter *w = reinterpret_cast<EventWaiter *>(
+          static_cast<std::size_t>(addr));
+
+     if (objc == 9)
+     {
+          EventInfo &info = w->info;
+          info.widget = Tcl_GetString(objv[2]);
+          info.x = intOrZero(objv[3]);
+          info.y = intOrZero(objv[4]);
+          info.rootX = intOrZero(objv[5]);
+          info.rootY = intOrZero(objv[6]);
+          info.button = intOrZero(objv[7]);
+          info.keysym = Tcl_GetString(objv[8]);
+          if (info.keysym == "??")
+          {
+               info.keysym.clear();
+          }
+     }
+     else
+     {
+          // the widget is being destroyed
+          w->destroyed = true;
+     }
+
+     stopEventWait(*w);
+     resumeWaiter(*w);
+     return TCL_OK;
+}
+
+void Tk::details::startEventWait(EventWaiter &w)
+{
+     static bool registered = false;
+     if (!registered)
+     {
+          Tcl_CreateObjCommand(getInterp(), resumeCommand,
+               resumeHandler, 0, 0);
+          registered = true;
+     }
+
+     w.tag = waitTagPrefix;
+     w.tag += std::to_string(++waitId);
+
+     std::string script(resumeCommand);
+     script += " ";
+     script += std::to_string(reinterpret_cast<std::size_t>(&w));
+
+     std::string bindEvent[] = { "bind", w.tag, w.sequence,
+          script + " %W %x %y %X %Y %b %K" };
+     std::string bindDestroy[] = { "bind", w.tag, "<Destroy>", script };
+     if (evalWords(bindEvent, 4) != TCL_OK ||
+          evalWords(bindDestroy, 4) != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+     w.token = &w;
+
+     std::string getTags[] = { "bindtags", w.widget };
+     if (evalWords(getTags, 2) != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+
+     Tcl_Obj *tags = Tcl_DuplicateObj(Tcl_GetObjResult(getInterp()));
+     Tcl_IncrRefCount(tags);
+     Tcl_Obj *tag = Tcl_NewStringObj(w.tag.data(),
+          static_cast<int>(w.tag.size()));
+     Tcl_ListObjReplace(0, tags, 0, 0, 1, &tag);
+
+     Tcl_Obj *objv[] = { Tcl_NewStringObj("bindtags", -1),
+          Tcl_NewStringObj(w.widget.data(),
+               static_cast<int>(w.widget.size())), tags };
+     Tcl_IncrRefCount(objv[0]);
+     Tcl_IncrRefCount(objv[1]);
+     int cc = Tcl_EvalObjv(getInterp(), 3, objv, 0);
+     Tcl_DecrRefCount(objv[0]);
+     Tcl_DecrRefCount(objv[1]);
+     Tcl_DecrRefCount(tags);
+     if (cc != TCL_OK)
+     {
+          throw TkError(Tcl_GetStringResult(getInterp()));
+     }
+}
+
+void Tk::details::stopEventWait(EventWaiter &w)
+{
+     if (w.token == 0)
+     {
+          return;
+     }
+     w.token = 0;
+
+     // the widget can be already destroyed, so the errors are ignored
+     std::string unbindEvent[] = { "bind", w.tag, w.sequence, "" };
+     std::string unbindDestroy[] = { "bind", w.tag, "<Destroy>", "" };
+     evalWords(unbindEvent, 4);
+     evalWords(unbindDestroy, 4);
+
+     std::string script("if {[winfo exists ");
+     script += w.widget;
+     script += "]} {bindtags ";
+     script += w.widget;
+     script += " [lsearch -all -inline -not -exact [bindtags ";
+     script += w.widget;
+     script += "] ";
+     script += w.tag;
+     script += "]}";
+     Tcl_Eval(getInterp(), script.c_str());
+     Tcl_ResetResult(getInterp());
+}
+
+// thread pool
+
+namespace { // anonymous
+
+// the states of the pool waiter
+enum { poolIdle, poolQueued, poolRunning, poolDone };
+
+struct PoolEvent
+{
+     Tcl_Event header;
+     PoolWaiter *w;
+};
+
+extern "C" int poolEventProc(Tcl_Event *ev, int flags);
+
+extern "C"
+int poolEventMatch(Tcl_Event *ev, ClientData cd)
+{
+     return ev->proc == poolEventProc &&
+          reinterpret_cast<PoolEvent *>(ev)->w == cd;
+}
+
+class ThreadPool
+{
+public:
+     ThreadPool()
+     {
+          unsigned n = std::thread::hardware_concurrency();
+          if (n < 2)
+          {
+               n = 2;
+          }
+
+          // the workers are never joined, so that the program
+          // does not wait for them at exit
+          for (unsigned i = 0; i != n; ++i)
+          {
+               std::thread(&ThreadPool::worker, this).detach();
+          }
+     }
+
+     void submit(PoolWaiter &w)
+     {
+          std::lock_guard<std::mutex> lock(mutex_);
+          w.state = poolQueued;
+          queue_.push_back(&w);
+          ready_.notify_one();
+     }
+
+     // returns true if the result event has to be removed
+     bool cancel(PoolWaiter &w)
+     {
+          std::unique_lock<std::mutex> lock(mutex_);
+          if (w.state == poolQueued)
+          {
+               for (std::deque<PoolWaiter *>::iterator it = queue_.begin();
+                    it != queue_.end(); ++it)
+               {
+                    if (*it == &w)
+                    {
+                         queue_.erase(it);
+                         break;
+                    }
+               }
+               w.state = poolIdle;
+               return false;
+          }
+
+          // the work cannot be interrupted
+          while (w.state == poolRunning)
+          {
+               finished_.wait(lock);
+          }
+          return w.state == poolDone;
+     }
+
+     void finish(PoolWaiter &w)
+     {
+          std::lock_guard<std::mutex> lock(mutex_);
+          w.state = poolIdle;
+     }
+
+private:
+     void worker()
+     {
+          for (;;)
+          {
+               PoolWaiter *w;
+               {
+                    std::unique_lock<std::mutex> lock(mutex_);
+                    while (queue_.empty())
+                    {
+                         ready_.wait(lock);
+                    }
+                    w = queue_.front();
+                    queue_.pop_front();
+                    w->state = poolRunning;
+               }
+
+               w->work(w->workArg);
+
+               std::lock_guard<std::mutex> lock(mutex_);
+               w->state = poolDone;
+
+               // the result is delivered to the waiting thread
+               // as a Tcl event
+               PoolEvent *ev = reinterpret_cast<PoolEvent *>(
+                    ckalloc(sizeof(PoolEvent)));
+               ev->header.proc = poolEventProc;
+               ev->w = w;
+               Tcl_ThreadId owner = static_cast<Tcl_ThreadId>(w->owner);
+               Tcl_ThreadQueueEvent(owner, &ev->header, TCL_QUEUE_TAIL);
+               Tcl_ThreadAlert(owner);
+
+               finished_.notify_all();
+          }
+     }
+
+     std::mutex mutex_;
+     std::condition_variable ready_;
+     std::condition_variable finished_;
+     std::deque<PoolWaiter *> queue_;
+};
+
+ThreadPool & threadPool()
+{
+     static ThreadPool *pool = new ThreadPool;
+     return *pool;
+}
+
+extern "C"
+int poolEventProc(Tcl_Event *ev, int flags)
+{
+     // delivered together with other file events
+     if (!(flags & TCL_FILE_EVENTS))
+     {
+          return 0;
+     }
+
+     PoolWaiter *w = reinterpret_cast<PoolEvent *>(ev)->w;
+     threadPool().finish(*w);
+     w->token = 0;
+     resumeWaiter(*w);
+     return 1;
+}
+
+} // namespace anonymous
+
+void Tk::details::startPoolWork(PoolWaiter &w)
+{
+     w.owner = Tcl_GetCurrentThread();
+     w.token = &w;
+     threadPool().submit(w);
+}
+
+void Tk::details::stopPoolWork(PoolWaiter &w)
+{
+     if (w.token == 0)
+     {
+          return;
+     }
+     w.token = 0;
+
+     if (threadPool().cancel(w))
+     {
+          Tcl_DeleteEvents(poolEventMatch, static_cast<ClientData>(&w));
+          threadPool().finish(w);
+     }
+}
+
+void Tk::details::asyncError(std::exception_ptr e)
+{
+     try
+     {
+          std::rethrow_exception(e);
+     }
+     catch (std::exception const &ex)
+     {
+          backgroundError(ex);
+     }
+     catch (...)
+     {
+          backgroundError(std::runtime_error("Unknown exception"));
+     }
+}
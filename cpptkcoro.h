@@ -0,0 +1,306 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+#ifndef CPPTKCORO_H_INCLUDED
+#define CPPTKCORO_H_INCLUDED
+
+#include "cpptk.h"
+#include <exception>
+#include <string>
+#include <type_traits>
+#include <utility>
+
+namespace Tk
+{
+
+// attributes of the event that resumed nextEvent
+struct EventInfo
+{
+     EventInfo() : x(0), y(0), rootX(0), rootY(0), button(0) {}
+
+     std::string widget;
+     int x;
+     int y;
+     int rootX;
+     int rootY;
+     int button;          // 0 if not a button event
+     std::string keysym;  // empty if not a key event
+};
+
+namespace details
+{
+
+// support for the awaitables below
+// (independent of the coroutine machinery, so that the library
+// itself does not have to be compiled as C++20)
+
+typedef void (*ResumeFn)(void *);
+
+struct Waiter
+{
+     Waiter() : resume(0), handle(0), token(0) {}
+
+     ResumeFn resume;     // resumes the coroutine
+     void *handle;        // address of the coroutine handle
+     void *token;         // non-zero while the waiter is registered
+};
+
+void startTimer(Waiter &w, int ms);
+void stopTimer(Waiter &w);
+
+void startIdle(Waiter &w);
+void stopIdle(Waiter &w);
+
+struct EventWaiter : Waiter
+{
+     EventWaiter() : destroyed(false) {}
+
+     std::string widget;
+     std::string tag;
+     std::string sequence;
+     EventInfo info;
+     bool destroyed;
+};
+
+void startEventWait(EventWaiter &w);
+void stopEventWait(EventWaiter &w);
+
+struct PoolWaiter : Waiter
+{
+     PoolWaiter() : work(0), workArg(0), owner(0), state(0) {}
+
+     ResumeFn work;       // called in the worker thread
+     void *workArg;
+     void *owner;         // thread to be resumed in
+     int state;           // guarded by the pool
+};
+
+void startPoolWork(PoolWaiter &w);
+void stopPoolWork(PoolWaiter &w);
+
+// reports exceptions that escaped from the coroutine
+void asyncError(std::exception_ptr e);
+
+} // namespace details
+
+} // namespace Tk
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <optional>
+
+namespace Tk
+{
+
+// The coroutine type for UI flows - the coroutine starts immediately
+// and, after each co_await, is resumed from the event loop.
+// Exceptions that escape from it are reported as Tcl background errors.
+
+struct Async
+{
+     struct promise_type
+     {
+          Async get_return_object() { return Async(); }
+          std::suspend_never initial_suspend() noexcept { return {}; }
+          std::suspend_never final_suspend() noexcept { return {}; }
+          void return_void() {}
+          void unhandled_exception()
+          {
+               details::asyncError(std::current_exception());
+          }
+     };
+};
+
+namespace details
+{
+
+inline void resumeCoroutine(void *handle)
+{
+     std::coroutine_handle<>::from_address(handle).resume();
+}
+
+// the awaiters keep the registration in the coroutine frame
+// and cancel it if the coroutine is destroyed while waiting
+
+class SleepAwaiter
+{
+public:
+     explicit SleepAwaiter(int ms) : ms_(ms) {}
+     SleepAwaiter(SleepAwaiter const &other) : ms_(other.ms_) {}
+     ~SleepAwaiter() { stopTimer(w_); }
+
+     bool await_ready() const { return false; }
+     void await_suspend(std::coroutine_handle<> h)
+     {
+          w_.resume = resumeCoroutine;
+          w_.handle = h.address();
+          startTimer(w_, ms_);
+     }
+     void await_resume() {}
+
+private:
+     int ms_;
+     Waiter w_;
+};
+
+class IdleAwaiter
+{
+public:
+     IdleAwaiter() {}
+     IdleAwaiter(IdleAwaiter const &) {}
+     ~IdleAwaiter() { stopIdle(w_); }
+
+     bool await_ready() const { return false; }
+     void await_suspend(std::coroutine_handle<> h)
+     {
+          w_.resume = resumeCoroutine;
+          w_.handle = h.address();
+          startIdle(w_);
+     }
+     void await_resume() {}
+
+private:
+     Waiter w_;
+};
+
+class EventAwaiter
+{
+public:
+     EventAwaiter(std::string const &widget, std::string const &seq)
+     {
+          w_.widget = widget;
+          w_.sequence = seq;
+     }
+     EventAwaiter(EventAwaiter const &other)
+     {
+          w_.widget = other.w_.widget;
+          w_.sequence = other.w_.sequence;
+     }
+     ~EventAwaiter() { stopEventWait(w_); }
+
+     bool await_ready() const { return false; }
+     void await_suspend(std::coroutine_handle<> h)
+     {
+          w_.resume = resumeCoroutine;
+          w_.handle = h.address();
+          startEventWait(w_);
+     }
+     EventInfo await_resume()
+     {
+          if (w_.destroyed)
+          {
+               throw TkError("Widget " + w_.widget +
+                    " was destroyed while waiting for " + w_.sequence);
+          }
+          return w_.info;
+     }
+
+private:
+     EventWaiter w_;
+};
+
+template <class F>
+class PoolAwaiter
+{
+public:
+     typedef typename std::invoke_result<F>::type result_type;
+
+     explicit PoolAwaiter(F f) : f_(std::move(f)) {}
+     PoolAwaiter(PoolAwaiter const &other) : f_(other.f_) {}
+     ~PoolAwaiter() { stopPoolWork(w_); }
+
+     bool await_ready() const { return false; }
+     void await_suspend(std::coroutine_handle<> h)
+     {
+          w_.resume = resumeCoroutine;
+          w_.handle = h.address();
+          w_.work = &PoolAwaiter::run;
+          w_.workArg = this;
+          startPoolWork(w_);
+     }
+     result_type await_resume()
+     {
+          if (error_)
+          {
+               std::rethrow_exception(error_);
+          }
+          if constexpr (!std::is_void<result_type>::value)
+          {
+               return std::move(*result_);
+          }
+     }
+
+private:
+     // called in the worker thread
+     static void run(void *p)
+     {
+          PoolAwaiter *self = static_cast<PoolAwaiter *>(p);
+          try
+          {
+               if constexpr (std::is_void<result_type>::value)
+               {
+                    self->f_();
+               }
+               else
+               {
+                    self->result_.emplace(self->f_());
+               }
+          }
+          catch (...)
+          {
+               self->error_ = std::current_exception();
+          }
+     }
+
+     typedef typename std::conditional<std::is_void<result_type>::value,
+          int, result_type>::type stored_type;
+
+     F f_;
+     PoolWaiter w_;
+     std::optional<stored_type> result_;
+     std::exception_ptr error_;
+};
+
+} // namespace details
+
+// resumes the coroutine after the given time (in milliseconds)
+inline details::SleepAwaiter sleep(int ms)
+{
+     return details::SleepAwaiter(ms);
+}
+
+// resumes the coroutine when Tk has nothing else to do
+// (after the pending redraws)
+inline details::IdleAwaiter idle()
+{
+     return details::IdleAwaiter();
+}
+
+// resumes the coroutine when the given event happens in the widget;
+// throws TkError if the widget is destroyed before that
+inline details::EventAwaiter nextEvent(std::string const &widget,
+     std::string const &seq)
+{
+     return details::EventAwaiter(widget, seq);
+}
+
+// runs the function in a worker thread and resumes the coroutine
+// (in the GUI thread) with its result; the function must not use Tk
+template <class F>
+details::PoolAwaiter<F> onThreadPool(F f)
+{
+     return details::PoolAwaiter<F>(std::move(f));
+}
+
+} // namespace Tk
+
+#endif // C++20 coroutines
+
+#endif // CPPTKCORO_H_INCLUDED
@@ -0,0 +1,702 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+#include "cpptkviews.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+
+using namespace Tk;
+using namespace Tk::details;
+
+namespace { // anonymous
+
+// the components delete their callbacks themselves
+template <class T>
+std::string addMemberCallback(T *obj, void (T::*h)(Params const &))
+{
+     return addCallback(std::shared_ptr<CallbackBase>(
+          new MemberCallback<T>(obj, h)), false);
+}
+
+// returns the length of the longest prefix of the buffer
+// that does not end with an incomplete UTF-8 sequence
+std::size_t completeUtf8(char const *buf, std::size_t len)
+{
+     std::size_t i = len;
+     for (int back = 0; i != 0 && back != 4; ++back)
+     {
+          unsigned char c = static_cast<unsigned char>(buf[--i]);
+          if ((c & 0xC0) != 0x80)
+          {
+               // the lead byte of the last sequence
+               std::size_t need = 1;
+               if      ((c & 0xE0) == 0xC0) need = 2;
+               else if ((c & 0xF0) == 0xE0) need = 3;
+               else if ((c & 0xF8) == 0xF0) need = 4;
+
+               return len - i >= need ? len : i;
+          }
+     }
+     return len;
+}
+
+// flushes the log view in a single evaluation: checks whether the view
+// is at the bottom, inserts the pairs of text and tag list, deletes the
+// head of the text up to the given index (unless it is empty) and
+// follows the new lines
+char const *logFlushProc =
+     "namespace eval CppTk {proc logFlush {w first args} {"
+     "set follow [expr {[lindex [$w yview] 1] >= 1.0}]; "
+     "$w insert end {*}$args; "
+     "if {$first ne {}} {$w delete 1.0 $first}; "
+     "if {$follow} {$w yview moveto 1.0}}}";
+
+} // namespace anonymous
+
+// virtual listbox
+
+Tk::VirtualListbox::VirtualListbox(std::string const &listbox,
+     std::string const &scrollbar, RowSource const &rows, std::size_t count,
+     std::size_t overscan)
+     : name_(listbox), scrollbar_(scrollbar), rows_(rows), count_(count),
+       overscan_(overscan), visible_(0), single_(false),
+       top_(0), first_(0), last_(0)
+{
+     int h = name_ << cget(height);
+     visible_ = h > 0 ? static_cast<std::size_t>(h) : 10;
+
+     std::string mode(name_ << cget(selectmode));
+     single_ = (mode == "single" || mode == "browse");
+
+     callbacks_.push_back(addMemberCallback(this,
+          &VirtualListbox::onYScroll));
+     callbacks_.push_back(addMemberCallback(this,
+          &VirtualListbox::onSelect));
+     callbacks_.push_back(addMemberCallback(this,
+          &VirtualListbox::onConfigure));
+
+     name_ << configure() -yscrollcommand(callbacks_[0]);
+     eval("bind " + name_ + " <<ListboxSelect>> " +
+          callbackWord(callbacks_[1]));
+     eval("bind " + name_ + " <Configure> " + callbackWord(callbacks_[2]));
+
+     if (!scrollbar_.empty())
+     {
+          callbacks_.push_back(addMemberCallback(this,
+               &VirtualListbox::onScrollbar));
+          scrollbar_ << configure() -command(callbacks_[3]);
+     }
+
+     render(0, true);
+     updateScrollbar();
+}
+
+Tk::VirtualListbox::~VirtualListbox()
+{
+     // the widgets can be already destroyed
+     try
+     {
+          if (static_cast<int>(winfo(exists, name_)))
+          {
+               name_ << configure() -yscrollcommand("");
+               eval("bind " + name_ + " <<ListboxSelect>> {}");
+               eval("bind " + name_ + " <Configure> {}");
+          }
+          if (!scrollbar_.empty() &&
+               static_cast<int>(winfo(exists, scrollbar_)))
+          {
+               scrollbar_ << configure() -command(std::string());
+          }
+     }
+     catch (...)
+     {
+     }
+
+     for (std::size_t i = 0; i != callbacks_.size(); ++i)
+     {
+          try
+          {
+               deleteCallback(callbacks_[i]);
+          }
+          catch (...)
+          {
+          }
+     }
+}
+
+void Tk::VirtualListbox::setCount(std::size_t count)
+{
+     count_ = count;
+
+     std::set<std::size_t>::iterator it = selected_.lower_bound(count_);
+     selected_.erase(it, selected_.end());
+
+     std::size_t maxTop = count_ > visible_ ? count_ - visible_ : 0;
+     render(std::min(top_, maxTop), true);
+     updateScrollbar();
+}
+
+void Tk::VirtualListbox::refresh()
+{
+     render(top_, true);
+}
+
+void Tk::VirtualListbox::see(std::size_t index)
+{
+     if (index < top_)
+     {
+          scrollTo(static_cast<std::ptrdiff_t>(index));
+     }
+     else if (index >= top_ + visible_)
+     {
+          scrollTo(static_cast<std::ptrdiff_t>(index - visible_ + 1));
+     }
+}
+
+std::vector<std::size_t> Tk::VirtualListbox::selection() const
+{
+     return std::vector<std::size_t>(selected_.begin(), selected_.end());
+}
+
+void Tk::VirtualListbox::select(std::size_t index, bool on)
+{
+     if (on)
+     {
+          if (single_)
+          {
+               clearSelection();
+          }
+          selected_.insert(index);
+     }
+     else
+     {
+          selected_.erase(index);
+     }
+
+     if (index >= first_ && index < last_)
+     {
+          name_ << Tk::selection(on ? "set" : "clear", index - first_);
+     }
+}
+
+void Tk::VirtualListbox::clearSelection()
+{
+     selected_.clear();
+     name_ << Tk::selection(clear, 0, end);
+}
+
+void Tk::VirtualListbox::scrollTo(std::ptrdiff_t newTop)
+{
+     std::ptrdiff_t maxTop = count_ > visible_ ?
+          static_cast<std::ptrdiff_t>(count_ - visible_) : 0;
+     if (newTop > maxTop) newTop = maxTop;
+     if (newTop < 0)      newTop = 0;
+
+     if (static_cast<std::size_t>(newTop) != top_)
+     {
+          render(static_cast<std::size_t>(newTop), false);
+          updateScrollbar();
+     }
+}
+
+// keeps in the listbox only the rows around the new top row,
+// reusing those rows that are already there
+void Tk::VirtualListbox::render(std::size_t newTop, bool full)
+{
+     std::size_t first = newTop > overscan_ ? newTop - overscan_ : 0;
+     std::size_t last = std::min(newTop + visible_ + overscan_, count_);
+
+     if (full || first >= last_ || last <= first_)
+     {
+          name_ << deleteentry(0, end);
+          insertRows(end, first, last);
+          selectRows(first, first, last);
+     }
+     else
+     {
+          // the head of the listbox
+          if (first > first_)
+          {
+               name_ << deleteentry(0, first - first_ - 1);
+          }
+          else if (first < first_)
+          {
+               insertRows("0", first, first_);
+               selectRows(first, first, first_);
+          }
+
+          // the tail of the listbox
+          if (last < last_)
+          {
+               name_ << deleteentry(last - first, end);
+          }
+          else if (last > last_)
+          {
+               insertRows(end, last_, last);
+               selectRows(first, last_, last);
+          }
+     }
+
+     first_ = first;
+     last_ = last;
+     top_ = newTop;
+
+     name_ << yview(top_ - first_);
+}
+
+// inserts the rows of the model with a single command,
+// passing them without quoting
+void Tk::VirtualListbox::insertRows(std::string const &where,
+     std::size_t from, std::size_t to)
+{
+     if (from == to)
+     {
+          return;
+     }
+
+     std::string str(name_);
+     str += " insert ";
+     str += where;
+     std::shared_ptr<Command> cmd(new Command(str));
+     for (std::size_t i = from; i != to; ++i)
+     {
+          cmd->appendObj(makeObj(rows_(i)));
+     }
+     cmd->invokeOnce();
+}
+
+// restores the selection of the rows that have just been inserted
+// (base is the model index of the first row in the listbox)
+void Tk::VirtualListbox::selectRows(std::size_t base,
+     std::size_t from, std::size_t to)
+{
+     std::set<std::size_t>::const_iterator it = selected_.lower_bound(from);
+     for ( ; it != selected_.end() && *it < to; ++it)
+     {
+          name_ << Tk::selection("set", *it - base);
+     }
+}
+
+void Tk::VirtualListbox::updateScrollbar()
+{
+     if (scrollbar_.empty())
+     {
+          return;
+     }
+
+     double first = 0.0;
+     double last = 1.0;
+     if (count_ != 0)
+     {
+          first = static_cast<double>(top_) / count_;
+          last = static_cast<double>(std::min(top_ + visible_, count_))
+               / count_;
+     }
+     scrollbar_ << set(first, last);
+}
+
+// called by the scrollbar with "moveto fraction"
+// or "scroll number units|pages"
+void Tk::VirtualListbox::onScrollbar(Params const &p)
+{
+     std::string what(p.get<std::string>(1));
+     if (what == "moveto")
+     {
+          double f = p.get<double>(2);
+          scrollTo(static_cast<std::ptrdiff_t>(f * count_ + 0.5));
+     }
+     else if (what == "scroll" && p.getArgc() > 3)
+     {
+          std::ptrdiff_t n = p.get<int>(2);
+          if (p.get<std::string>(3) == "pages")
+          {
+               n *= static_cast<std::ptrdiff_t>(visible_);
+          }
+          scrollTo(static_cast<std::ptrdiff_t>(top_) + n);
+     }
+}
+
+// called by the listbox when its own view has changed
+// (with the mouse wheel, keyboard, etc.)
+void Tk::VirtualListbox::onYScroll(Params const &p)
+{
+     double f = p.get<double>(1);
+     std::size_t n = last_ - first_;
+     std::size_t newTop = first_ + static_cast<std::size_t>(f * n + 0.5);
+
+     scrollTo(static_cast<std::ptrdiff_t>(newTop));
+}
+
+void Tk::VirtualListbox::onSelect(Params const &)
+{
+     std::vector<int> cur = name_ << curselection();
+
+     if (single_ && !cur.empty())
+     {
+          selected_.clear();
+     }
+     else
+     {
+          selected_.erase(selected_.lower_bound(first_),
+               selected_.lower_bound(last_));
+     }
+
+     for (std::size_t i = 0; i != cur.size(); ++i)
+     {
+          selected_.insert(first_ + cur[i]);
+     }
+}
+
+// recomputes the number of visible rows after the listbox was resized
+void Tk::VirtualListbox::onConfigure(Params const &)
+{
+     int h = winfo(height, name_);
+     for (int attempt = 0; attempt != 4; ++attempt)
+     {
+          int firstRow = name_ << nearest(0);
+          int lastRow = name_ << nearest(h - 1);
+          std::size_t v = static_cast<std::size_t>(lastRow - firstRow + 1);
+
+          // if the listbox was not filled enough, the estimate
+          // is limited by the rows it has, so it has to be repeated
+          bool limited = first_ + lastRow + 1 == last_ && last_ < count_;
+          visible_ = limited ? v * 2 : v;
+          render(top_, false);
+          if (!limited)
+          {
+               break;
+          }
+     }
+
+     updateScrollbar();
+}
+
+// text loader
+
+Tk::TextLoader::TextLoader(std::string const &textw, std::istream &is,
+     std::size_t chunkSize, int budget)
+     : name_(textw), is_(is), chunkSize_(chunkSize), budget_(budget)
+{
+     init();
+}
+
+Tk::TextLoader::TextLoader(std::string const &textw,
+     std::string const &fileName, std::size_t chunkSize, int budget)
+     : name_(textw),
+       file_(new std::ifstream(fileName.c_str(), std::ios::binary)),
+       is_(*file_), chunkSize_(chunkSize), budget_(budget)
+{
+     if (!*file_)
+     {
+          throw TkError("Cannot open file " + fileName);
+     }
+
+     init();
+}
+
+void Tk::TextLoader::init()
+{
+     running_ = false;
+     failed_ = false;
+     loaded_ = 0;
+     total_ = 0;
+
+     if (chunkSize_ == 0)
+     {
+          chunkSize_ = 65536;
+     }
+
+     // the total size is known only for seekable streams
+     std::istream::pos_type pos = is_.tellg();
+     if (pos != std::istream::pos_type(-1) &&
+          is_.seekg(0, std::ios::end))
+     {
+          std::istream::pos_type endPos = is_.tellg();
+          if (endPos != std::istream::pos_type(-1) && endPos >= pos)
+          {
+               total_ = static_cast<std::size_t>(endPos - pos);
+          }
+          is_.seekg(pos);
+     }
+     is_.clear();
+
+     idleCallback_ = addMemberCallback(this, &TextLoader::onIdle);
+     sliceCallback_ = addMemberCallback(this, &TextLoader::onSlice);
+}
+
+Tk::TextLoader::~TextLoader()
+{
+     try
+     {
+          if (running_)
+          {
+               unschedule();
+          }
+     }
+     catch (...)
+     {
+     }
+
+     try
+     {
+          deleteCallback(idleCallback_);
+          deleteCallback(sliceCallback_);
+     }
+     catch (...)
+     {
+     }
+}
+
+void Tk::TextLoader::start()
+{
+     if (!running_)
+     {
+          running_ = true;
+          schedule();
+     }
+}
+
+void Tk::TextLoader::cancel()
+{
+     if (running_)
+     {
+          unschedule();
+          finish(false);
+     }
+}
+
+// the next slice is run after the pending redraws were done
+// (after idle), but as a timer event, so that it does not
+// starve other idle handlers
+void Tk::TextLoader::schedule()
+{
+     std::string id(afteridle(idleCallback_));
+     idleId_ = id;
+     sliceId_.clear();
+}
+
+void Tk::TextLoader::unschedule()
+{
+     if (!idleId_.empty())
+     {
+          after("cancel", idleId_);
+     }
+     if (!sliceId_.empty())
+     {
+          after("cancel", sliceId_);
+     }
+     idleId_.clear();
+     sliceId_.clear();
+}
+
+void Tk::TextLoader::finish(bool completed)
+{
+     running_ = false;
+     pending_.clear();
+     if (finished_)
+     {
+          finished_(completed);
+     }
+}
+
+void Tk::TextLoader::onIdle(Params const &)
+{
+     std::string id(after(0, sliceCallback_));
+     sliceId_ = id;
+}
+
+void Tk::TextLoader::onSlice(Params const &)
+{
+     if (!running_)
+     {
+          return;
+     }
+
+     typedef std::chrono::steady_clock Clock;
+     Clock::time_point deadline =
+          Clock::now() + std::chrono::milliseconds(budget_);
+
+     std::string insertCmd(name_);
+     insertCmd += " insert end";
+
+     std::vector<char> buf(chunkSize_ + 4);
+     bool eof = false;
+     do
+     {
+          std::size_t keep = pending_.size();
+          std::copy(pending_.begin(), pending_.end(), buf.begin());
+          is_.read(&buf[keep], static_cast<std::streamsize>(chunkSize_));
+          std::size_t got = static_cast<std::size_t>(is_.gcount());
+          eof = !is_;
+
+          std::size_t len = keep + got;
+          std::size_t n = eof ? len : completeUtf8(&buf[0], len);
+          pending_.assign(buf.begin() + n, buf.begin() + len);
+          loaded_ += got;
+
+          if (n != 0)
+          {
+               // the chunk is passed as a single object, without quoting
+               std::shared_ptr<Command> cmd(new Command(insertCmd));
+               cmd->appendObj(makeObj(std::string(&buf[0], n)));
+               cmd->invokeOnce();
+          }
+     }
+     while (!eof && Clock::now() < deadline);
+
+     if (progress_)
+     {
+          progress_(loaded_, total_);
+     }
+
+     if (eof)
+     {
+          // a read error is not the end of the input
+          failed_ = is_.bad();
+          finish(!failed_);
+     }
+     else
+     {
+          schedule();
+     }
+}
+
+// log view
+
+Tk::LogView::LogView(std::string const &textw, std::size_t maxLines,
+     int interval)
+     : name_(textw), maxLines_(maxLines != 0 ? maxLines : 1),
+       interval_(interval), ring_(maxLines_), head_(0), size_(0),
+       lines_(0), dropped_(0)
+{
+     callback_ = addMemberCallback(this, &LogView::onFlush);
+     eval(logFlushProc);
+}
+
+Tk::LogView::~LogView()
+{
+     try
+     {
+          if (!afterId_.empty())
+          {
+               after("cancel", afterId_);
+          }
+     }
+     catch (...)
+     {
+     }
+
+     try
+     {
+          deleteCallback(callback_);
+     }
+     catch (...)
+     {
+     }
+}
+
+void Tk::LogView::append(std::string const &line, std::string const &tag)
+{
+     std::size_t pos = (head_ + size_) % ring_.size();
+     if (size_ == ring_.size())
+     {
+          // the oldest line would be trimmed anyway
+          head_ = (head_ + 1) % ring_.size();
+          ++dropped_;
+     }
+     else
+     {
+          ++size_;
+     }
+
+     // the slots are reused, together with their buffers
+     ring_[pos].line = line;
+     ring_[pos].tag = tag;
+
+     if (afterId_.empty())
+     {
+          std::string id(after(interval_, callback_));
+          afterId_ = id;
+     }
+}
+
+void Tk::LogView::flush()
+{
+     if (!afterId_.empty())
+     {
+          after("cancel", afterId_);
+          afterId_.clear();
+     }
+
+     if (size_ == 0)
+     {
+          return;
+     }
+
+     for (std::size_t i = 0; i != size_; ++i)
+     {
+          Entry const &e = ring_[(head_ + i) % ring_.size()];
+          lines_ += 1 + std::count(e.line.begin(), e.line.end(), '\n');
+     }
+
+     // the head is trimmed in the same evaluation
+     // (the last line of the text widget is always empty)
+     std::string script("CppTk::logFlush ");
+     script += name_;
+     if (lines_ > maxLines_)
+     {
+          script += " end-";
+          script += toString(maxLines_ + 1);
+          script += "lines";
+          lines_ = maxLines_;
+     }
+     else
+     {
+          script += " {}";
+     }
+
+     // all lines are inserted with a single command,
+     // as pairs of text and tag list
+     std::shared_ptr<Command> cmd(new Command(script));
+     std::string text;
+     for (std::size_t i = 0; i != size_; ++i)
+     {
+          Entry const &e = ring_[(head_ + i) % ring_.size()];
+          text.assign(e.line);
+          text += '\n';
+          cmd->appendObj(makeObj(text));
+          cmd->appendObj(makeObj(e.tag));
+     }
+
+     cmd->invokeOnce();
+
+     head_ = 0;
+     size_ = 0;
+}
+
+void Tk::LogView::clear()
+{
+     if (!afterId_.empty())
+     {
+          after("cancel", afterId_);
+          afterId_.clear();
+     }
+
+     head_ = 0;
+     size_ = 0;
+     lines_ = 0;
+     name_ << deletetext(txt(1,0), end);
+}
+
+void Tk::LogView::onFlush(Params const &)
+{
+     afterId_.clear();
+     flush();
+}
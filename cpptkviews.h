@@ -0,0 +1,232 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+#ifndef CPPTKVIEWS_H_INCLUDED
+#define CPPTKVIEWS_H_INCLUDED
+
+#include "cpptk.h"
+#include <functional>
+#include <istream>
+#include <memory>
+#include <set>
+
+namespace Tk
+{
+
+// views built on top of the standard widgets,
+// for presenting large amounts of data
+
+// The VirtualListbox class presents a list of rows provided by
+// the C++ model, but keeps in the listbox only those rows that are
+// currently visible (plus some overscan).
+// The listbox and the scrollbar have to exist already; the scrollbar
+// is optional.
+// All indexes used by this class are indexes in the model.
+
+class VirtualListbox
+{
+public:
+     typedef std::function<std::string (std::size_t)> RowSource;
+
+     VirtualListbox(std::string const &listbox,
+          std::string const &scrollbar,
+          RowSource const &rows, std::size_t count,
+          std::size_t overscan = 16);
+     ~VirtualListbox();
+
+     std::string const & get() const { return name_; }
+
+     // to be called when the number of rows in the model has changed
+     void setCount(std::size_t count);
+     std::size_t getCount() const { return count_; }
+
+     // to be called when the content of the model has changed
+     void refresh();
+
+     // scrolls the view so that the given row is visible
+     void see(std::size_t index);
+
+     // index of the first visible row
+     std::size_t top() const { return top_; }
+
+     std::vector<std::size_t> selection() const;
+     void select(std::size_t index, bool on = true);
+     void clearSelection();
+
+private:
+     VirtualListbox(VirtualListbox const &);
+     VirtualListbox & operator=(VirtualListbox const &);
+
+     void scrollTo(std::ptrdiff_t newTop);
+     void render(std::size_t newTop, bool full);
+     void insertRows(std::string const &where,
+          std::size_t from, std::size_t to);
+     void selectRows(std::size_t base, std::size_t from, std::size_t to);
+     void updateScrollbar();
+
+     // Tk callbacks
+     void onScrollbar(details::Params const &p);
+     void onYScroll(details::Params const &p);
+     void onSelect(details::Params const &p);
+     void onConfigure(details::Params const &p);
+
+     std::string name_;
+     std::string scrollbar_;
+     RowSource rows_;
+     std::size_t count_;
+     std::size_t overscan_;
+     std::size_t visible_;
+     bool single_;
+
+     // first visible row and the rows kept in the listbox
+     std::size_t top_;
+     std::size_t first_;
+     std::size_t last_;
+
+     std::set<std::size_t> selected_;
+     std::vector<std::string> callbacks_;
+};
+
+// The TextLoader class streams the content of a file (or any other
+// input stream) into the text widget in chunks, during idle time.
+// Each slice of work inserts as many chunks as it can within the
+// given time budget, so that the GUI stays responsive.
+// The loading stops when the loader is destroyed.
+
+class TextLoader
+{
+public:
+     // called after each slice with the number of bytes loaded so far
+     // and the total size of the input (0 if not known)
+     typedef std::function<void (std::size_t, std::size_t)> Progress;
+
+     // called once at the end, with false if the loading was cancelled
+     // or stopped by a read error
+     typedef std::function<void (bool)> Finished;
+
+     // the stream has to live as long as the loader
+     TextLoader(std::string const &textw, std::istream &is,
+          std::size_t chunkSize = 65536, int budget = 10);
+     TextLoader(std::string const &textw, std::string const &fileName,
+          std::size_t chunkSize = 65536, int budget = 10);
+     ~TextLoader();
+
+     void onProgress(Progress const &p) { progress_ = p; }
+     void onFinished(Finished const &f) { finished_ = f; }
+
+     // starts loading at the end of the text widget
+     void start();
+     void cancel();
+
+     bool running() const { return running_; }
+     bool failed() const { return failed_; }
+     std::size_t loaded() const { return loaded_; }
+     std::size_t total() const { return total_; }
+
+private:
+     TextLoader(TextLoader const &);
+     TextLoader & operator=(TextLoader const &);
+
+     void init();
+     void schedule();
+     void unschedule();
+     void finish(bool completed);
+
+     // Tk callbacks
+     void onIdle(details::Params const &p);
+     void onSlice(details::Params const &p);
+
+     std::string name_;
+     std::unique_ptr<std::istream> file_;
+     std::istream &is_;
+     std::size_t chunkSize_;
+     int budget_;
+
+     bool running_;
+     bool failed_;       // the stream reported a read error
+     std::size_t loaded_;
+     std::size_t total_;
+
+     // incomplete UTF-8 sequence left from the previous chunk
+     std::string pending_;
+
+     Progress progress_;
+     Finished finished_;
+
+     std::string idleCallback_;
+     std::string sliceCallback_;
+     std::string idleId_;
+     std::string sliceId_;
+};
+
+// The LogView class appends lines to the text widget at a high rate.
+// The lines are buffered in a bounded ring and flushed at most once per
+// frame (interval is in milliseconds) with a single insert command;
+// in the same evaluation the oldest lines are deleted, so that the text
+// widget never keeps more than maxLines lines.
+// The view follows the new lines only if it was scrolled to the bottom.
+
+class LogView
+{
+public:
+     LogView(std::string const &textw, std::size_t maxLines = 10000,
+          int interval = 16);
+     ~LogView();
+
+     std::string const & get() const { return name_; }
+
+     // the tag (if not empty) is applied to the whole line
+     void append(std::string const &line,
+          std::string const &tag = std::string());
+
+     // inserts the buffered lines immediately
+     void flush();
+
+     // removes all lines, also those not yet flushed
+     void clear();
+
+     std::size_t pending() const { return size_; }
+     std::size_t lines() const { return lines_; }
+
+     // number of lines that were dropped from the full buffer
+     // before being displayed
+     std::size_t dropped() const { return dropped_; }
+
+private:
+     LogView(LogView const &);
+     LogView & operator=(LogView const &);
+
+     // Tk callbacks
+     void onFlush(details::Params const &p);
+
+     struct Entry
+     {
+          std::string line;
+          std::string tag;
+     };
+
+     std::string name_;
+     std::size_t maxLines_;
+     int interval_;
+
+     // the ring buffer of pending lines
+     std::vector<Entry> ring_;
+     std::size_t head_;
+     std::size_t size_;
+
+     std::size_t lines_;
+     std::size_t dropped_;
+
+     std::string callback_;
+     std::string afterId_;
+};
+
+} // namespace Tk
+
+#endif // CPPTKVIEWS_H_INCLUDED
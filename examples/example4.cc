@@ -1,27 +1,34 @@
 #include "cpptk.h"
+#include "cpptkviews.h"
 #include <iostream>
 #include <fstream>
+#include <memory>
 
 using namespace Tk;
 
+// the file is loaded in the background, chunk by chunk
+std::unique_ptr<TextLoader> loader;
+
 // this procedure will support the "File->Open" menu command
 void openFile()
 {
      // open standard "Open File" dialog
      
      std::string fileName(tk_getOpenFile());
+     if (fileName.empty())
+     {
+          return;
+     }
      
-     // read the file
+     // stop loading the previous file (if any)
      
-     std::ifstream f(fileName.c_str());
-     std::string fileContent(
-          std::istreambuf_iterator<char>(f.rdbuf()),
-          std::istreambuf_iterator<char>());
+     loader.reset();
      
-     // put the file content into the text widget
+     // stream the file content into the text widget
      
      ".t" << deletetext(txt(1,0), end);
-     ".t" << insert(end, fileContent);
+     loader.reset(new TextLoader(".t", fileName));
+     loader->start();
 }
 
 // this procedure will support the "File->Save" menu command
@@ -59,10 +59,6 @@ void newLine()
      ba += ::bd;
 }
 
-// note: this is used so that there is
-// only one callback registration
-string afterCommand;
-
 // this function makes each step of the animation
 void nextStep()
 {
@@ -71,9 +67,6 @@ void nextStep()
      // remove the oldest line from the queue and from the screen
      ".c" << deleteitem(lines.front());
      lines.pop();
-     
-     // call me again
-     after(delay, afterCommand);
 }
 
 int main(int, char *argv[])
@@ -82,6 +75,11 @@ int main(int, char *argv[])
      {     
           init(argv[0]);
           
+          // the size of the canvas is queried on every step,
+          // but it changes only when the window is resized
+          
+          enableQueryCache();
+          
           // create the canvas widget
           
           pack(canvas(".c") -background("black"))
@@ -94,11 +92,8 @@ int main(int, char *argv[])
                newLine();
           }
           
-          // register the callback function
-          afterCommand = callback(nextStep);
-          
-          // start animation
-          after(delay, afterCommand);
+          // start animation (nextStep will be called every delay ms)
+          setInterval(delay, nextStep);
           
           runEventLoop();
      }
@@ -111,6 +111,11 @@ int main(int, char *argv[])
      {     
           init(argv[0]);
           
+          // most cells do not change from one generation to the next,
+          // so there is no need to send their colors to Tk every time
+          
+          enableShadowState();
+          
           // create the control buttons
           
           frame(".f") -relief(raised) -borderwidth(1);
@@ -234,6 +234,25 @@ void commandsTest()
      CHECK("pack propagate .f 1");
      pack(slaves, ".f");
      CHECK("pack slaves .f");
+     {
+          std::vector<std::string> buttons;
+          buttons.push_back(".f.b1");
+          buttons.push_back(".f.b2");
+          LayoutBatch batch("pack", ".f", false);
+          batch.add(buttons.begin(), buttons.end()) -side(left) -padx(2);
+          batch.add(".f.b3") -side(left) -padx(2);
+          batch.add(".f.b4") -after(".f.b1");
+          batch.add(".f.b5") -after(".f.b1");
+          batch.commit();
+          CHECK("pack .f.b1 .f.b2 .f.b3 -side left -padx 2\n"
+               "pack .f.b4 -after .f.b1\npack .f.b5 -after .f.b1");
+     }
+     {
+          LayoutBatch batch("grid", ".f", false);
+          batch.add(".f.l1") -row(0) -column(0);
+          batch.add(".f.l2") -row(0) -column(0);
+     }
+     CHECK("grid .f.l1 -row 0 -column 0\ngrid .f.l2 -row 0 -column 0");
      
      panedwindow(".pw") -orient(horizontal);
      CHECK("panedwindow .pw -orient horizontal");
@@ -687,6 +706,12 @@ void widgetCommandsTest()
      crds.push_back(40);
      ".c" << coords("item", crds.begin(), crds.end());
      CHECK(".c coords item 10 20 30 40");
+     double dcrds[] = {10.5, 20, 30, 40.25};
+     ".c" << coords("item", dcrds, 4);
+     CHECK(".c coords item {10.5 20.0 30.0 40.25}");
+     Point pcrds[] = {Point(10, 20), Point(30, 40)};
+     ".c" << coords("item", pcrds, 2);
+     CHECK(".c coords item {10 20 30 40}");
      ".s" << coords();
      CHECK(".s coords");
      ".s" << coords(150);
@@ -709,6 +734,14 @@ void widgetCommandsTest()
      CHECK(".c create rectangle 10 20 30 40");
      ".c" << create(line, crds.begin(), crds.end());
      CHECK(".c create line 10 20 30 40");
+     double xy[] = {10.5, 20, 30, 40.25};
+     ".c" << create(line, xy, 4) -Tk::fill("red");
+     CHECK(".c create line {10.5 20.0 30.0 40.25} -fill red");
+     Point pts[] = {Point(10, 20), Point(30, 40)};
+     ".c" << create(line, pts, 2);
+     CHECK(".c create line {10 20 30 40}");
+     ".c" << coords("$item", xy, 4);
+     CHECK(".c coords $item {10.5 20.0 30.0 40.25}");
      
      ".lb" << curselection();
      CHECK(".lb curselection");
@@ -1212,6 +1245,8 @@ void widgetCommandsTest()
      CHECK(".c yview scroll 5 units");
      ".c" << yview(scroll, 5, pages);
      CHECK(".c yview scroll 5 pages");
+     ".lb" << yview(5);
+     CHECK(".lb yview 5");
      
 
      std::cout << "widget commands test OK\n";
@@ -1252,6 +1287,15 @@ void optionsTest()
      CallbackHandle cmd(callback(cb0));
      button(".b") -command(cmd);
      CHECK("button .b -command { CppTk::callback11 }");
+     CallbackHandle named(callback("pressed", cb0));
+     button(".b") -command(named);
+     CHECK("button .b -command { CppTk::named::pressed }");
+     CallbackHandle click(callback("click", cb1, event_x));
+     bind(".f", "<Button-1>", click);
+     CHECK("bind .f <Button-1> { CppTk::named::click %x }");
+     CallbackHandle check(callback("check", cbb0, valid_P));
+     ".e" << configure() -validatecommand(check);
+     CHECK(".e configure -validatecommand { CppTk::named::check %P }");
 
      button(".b") -compound(left);
      CHECK("button .b -compound left");
@@ -1443,6 +1487,74 @@ void additionalTclTest()
      
      eval("some explicit Tcl/Tk command");
      CHECK("some explicit Tcl/Tk command");
+     
+     Widget c(".c");
+     c << itemconfigure("item") -width(2);
+     CHECK(".c itemconfigure item -width 2");
+     c.configure() -text("hello \"world\"");
+     CHECK(".c configure -text {hello \"world\"}");
+     c.cget(text);
+     CHECK(".c cget -text");
+     c << create(line, 10, 20, 30, 40) -Tk::fill("red");
+     CHECK(".c create line 10 20 30 40 -fill red");
+     
+     enableShadowState();
+     ".c" << itemconfigure(5) -Tk::fill("red");
+     CHECK(".c itemconfigure 5 -fill red");
+     ".c" << itemconfigure(5) -Tk::fill("red");
+     assert(ss.str().empty());
+     ".c" << itemconfigure(5) -Tk::fill("red") -width(2);
+     CHECK(".c itemconfigure 5 -width 2");
+     ".c" << itemconfigure("mytag") -Tk::fill("red");
+     CHECK(".c itemconfigure mytag -fill red");
+     ".c" << itemconfigure(5) -Tk::fill("red");
+     CHECK(".c itemconfigure 5 -fill red");
+     ".b" << configure() -text("hello");
+     CHECK(".b configure -text \"hello\"");
+     c.configure() -text("hello");
+     CHECK(".c configure -text hello");
+     c.configure() -text("hello");
+     assert(ss.str().empty());
+     ".b" << configure() -text("hello");
+     assert(ss.str().empty());
+     destroy(".b");
+     CHECK("destroy .b");
+     ".b" << configure() -text("hello");
+     CHECK(".b configure -text \"hello\"");
+     {
+          ShadowStats st = getShadowStats();
+          assert(st.writes == 10 && st.suppressed == 4 && st.skipped == 3);
+     }
+     button(".b") -text("new");
+     CHECK("button .b -text \"new\"");
+     ".b" << configure() -text("hello");
+     CHECK(".b configure -text \"hello\"");
+     tk_setPalette("gray");
+     CHECK("tk_setPalette gray");
+     ".b" << configure() -text("hello");
+     CHECK(".b configure -text \"hello\"");
+     enableShadowState(false);
+     ".b" << configure() -text("hello");
+     CHECK(".b configure -text \"hello\"");
+
+     enableCallbackDispatch();
+     {
+          std::size_t live = liveCallbacks();
+          button(".b") -command(cb0);
+          CHECK("button .b -command {CppTk::dispatch 0 0}");
+          bind(".b", "<Button-1>", cb1, event_x);
+          CHECK("bind .b <Button-1> { CppTk::dispatch 1 0 %x }");
+          assert(liveCallbacks() == live + 2);
+          deleteCallback("CppTk::dispatch 0 0");
+          assert(liveCallbacks() == live + 1);
+          after(500, cb0);
+          CHECK("after 500 CppTk::dispatch 0 1");
+          
+          // the stale name does not delete the next callback in the slot
+          deleteCallback("CppTk::dispatch 0 0");
+          assert(liveCallbacks() == live + 2);
+     }
+     enableCallbackDispatch(false);
 
 
      std::cout << "additional Tcl test OK\n";
@@ -8,12 +8,67 @@
 //
 
 #include "../cpptk.h"
+#include "../cpptkviews.h"
+#include "../cpptkcoro.h"
 #include <iostream>
+#include <sstream>
 #include <vector>
 #include <cmath>
+#include <unistd.h>
 
 using namespace Tk;
 
+std::string rowText(std::size_t i)
+{
+     return "row " + std::to_string(i);
+}
+
+void pressed() {}
+
+void blocking() { usleep(30000); }
+
+std::vector<SlowCall> slowCalls;
+
+void slowCall(SlowCall const &call) { slowCalls.push_back(call); }
+
+int presses = 0;
+
+void countPress() { ++presses; }
+
+// the stream buffer that fails after the first read
+struct FailingBuf : std::streambuf
+{
+     FailingBuf() : calls(0) {}
+     int_type underflow()
+     {
+          if (calls++ != 0)
+          {
+               throw std::ios_base::failure("read error");
+          }
+          setg(text, text, text + 6);
+          return traits_type::to_int_type(text[0]);
+     }
+     char text[7] = "start\n";
+     int calls;
+};
+
+void buildPanel() { Tk::label(".lz.l") -text("lazy"); }
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+Async coroutineFlow(std::vector<std::string> &steps)
+{
+     co_await Tk::sleep(10);
+     steps.push_back("sleep");
+     co_await idle();
+     steps.push_back("idle");
+     EventInfo e = co_await nextEvent(".co", "<<Go>>");
+     steps.push_back(e.widget);
+     int r = co_await onThreadPool([] { return 6 * 7; });
+     steps.push_back(std::to_string(r));
+     eval("set ::coroutine 1");
+}
+#endif
+
 int main(int, char *argv[])
 {
      try
@@ -57,6 +112,700 @@ int main(int, char *argv[])
           
           
           std::cout << "conversion test OK\n";
+          
+          images(create, photo, "pix");
+          PhotoImage pix("pix");
+          unsigned char frame[] = {
+               255, 0, 0,   0, 255, 0,   0, 0, 0,
+               0, 0, 255,   255, 255, 255, 0, 0, 0 };
+          pix.put(frame, 2, 2, 9, PhotoImage::RGB);
+          std::vector<int> c1 = "pix" << get(1, 0);
+          assert(c1.size() == 3 && c1[0] == 0 && c1[1] == 255 && c1[2] == 0);
+          std::vector<int> c2 = "pix" << get(0, 1);
+          assert(c2.size() == 3 && c2[0] == 0 && c2[1] == 0 && c2[2] == 255);
+          
+          // partial update of the bottom right pixel only
+          frame[12] = frame[13] = frame[14] = 7;
+          frame[0] = 7;
+          pix.put(frame, 2, 2, 9, PhotoImage::BGR, Box(1, 1, 2, 2));
+          std::vector<int> c3 = "pix" << get(1, 1);
+          assert(c3[0] == 7 && c3[1] == 7 && c3[2] == 7);
+          std::vector<int> c4 = "pix" << get(0, 0);
+          assert(c4[0] == 255);
+          
+          PixelView v = pix.view();
+          assert(v.width == 2 && v.height == 2);
+          assert(v.pixel(1, 0)[v.offset[1]] == 255);
+          
+          unsigned char back[2 * 2 * 4];
+          pix.copyTo(back, 8, PhotoImage::BGRA);
+          assert(back[4 + 1] == 255);         // (1, 0) green
+          assert(back[8 + 0] == 255);         // (0, 1) blue
+          assert(back[3] == 255);             // opaque
+          
+          std::cout << "photo test OK\n";
+          
+          listbox(".vlb") -height(10) -selectmode(extended);
+          scrollbar(".vsb");
+          {
+               VirtualListbox vl(".vlb", ".vsb", rowText, 1000000, 5);
+               i = eval(".vlb size");
+               assert(i == 15);
+               
+               vl.see(500000);
+               assert(vl.top() == 499991);
+               i = eval(".vlb size");
+               assert(i == 20);
+               str = std::string(".vlb" << get(5));
+               assert(str == "row 499991");
+               
+               vl.select(499995);
+               vl.see(0);
+               vl.see(499995);
+               std::vector<int> cur = ".vlb" << curselection();
+               assert(cur.size() == 1 && cur[0] == 14);
+               assert(vl.selection().size() == 1);
+               
+               vl.setCount(3);
+               i = eval(".vlb size");
+               assert(i == 3 && vl.top() == 0 && vl.selection().empty());
+          }
+          
+          std::cout << "virtual listbox test OK\n";
+          
+          textw(".tl");
+          {
+               std::string content;
+               for (int line = 0; line != 300; ++line)
+               {
+                    content += "line {" + std::to_string(line) + "} [x] $y\n";
+               }
+               std::istringstream is(content);
+               
+               TextLoader tl(".tl", is, 100, 0);
+               int slices = 0;
+               bool completed = false;
+               tl.onProgress([&](std::size_t, std::size_t total)
+                    {
+                         ++slices;
+                         assert(total == content.size());
+                    });
+               tl.onFinished([&](bool c)
+                    {
+                         completed = c;
+                         eval("set ::loaded 1");
+                    });
+               tl.start();
+               eval("vwait ::loaded");
+               
+               assert(completed && !tl.running());
+               assert(tl.loaded() == content.size());
+               assert(slices > 1);
+               str = std::string(".tl" << get(txt(1,0), "end-1c"));
+               assert(str == content);
+          }
+          
+          // the loader that replaces another one on the same widget
+          // keeps its own callbacks
+          {
+               std::istringstream first("first\n");
+               std::istringstream second("second\n");
+               std::unique_ptr<TextLoader> tl(new TextLoader(".tl", first));
+               tl.reset(new TextLoader(".tl", second));
+               tl->onFinished([&](bool) { eval("set ::loaded 2"); });
+               tl->start();
+               eval("vwait ::loaded");
+               assert(tl->loaded() == second.str().size());
+          }
+          
+          // the read error is not reported as the end of the input
+          {
+               FailingBuf buf;
+               std::istream is(&buf);
+               TextLoader tl(".tl", is);
+               bool completed = true;
+               tl.onFinished([&](bool c)
+                    {
+                         completed = c;
+                         eval("set ::loaded 3");
+                    });
+               tl.start();
+               eval("vwait ::loaded");
+               assert(!completed && tl.failed() && !tl.running());
+          }
+          
+          std::cout << "text loader test OK\n";
+          
+          textw(".lg");
+          {
+               LogView lv(".lg", 100);
+               for (int line = 0; line != 250; ++line)
+               {
+                    lv.append("line " + std::to_string(line),
+                         line % 2 ? "odd" : "");
+               }
+               assert(lv.pending() == 100 && lv.dropped() == 150);
+               
+               lv.flush();
+               assert(lv.pending() == 0 && lv.lines() == 100);
+               str = std::string(".lg" << index(end));
+               assert(str == "102.0");
+               str = std::string(".lg" << get(txt(1,0), "1.end"));
+               assert(str == "line 150");
+               str = std::string(".lg" << tag(ranges, "odd"));
+               assert(!str.empty());
+               
+               lv.append("last");
+               lv.flush();
+               str = std::string(".lg" << get(txt(1,0), "1.end"));
+               assert(str == "line 151" && lv.lines() == 100);
+               
+               lv.clear();
+               str = std::string(".lg" << index(end));
+               assert(str == "2.0" && lv.lines() == 0);
+          }
+          
+          std::cout << "log view test OK\n";
+          
+          processPending();
+          eval("set ::tm 0; set ::id 0");
+          eval("after 0 {set ::tm 1}; after idle {set ::id 1}");
+          {
+               EventCounts counts = processEvents(1000, idleEvents);
+               assert(counts.idle == 1 && counts.timer == 0);
+               i = eval("set ::tm");
+               assert(i == 0);
+               
+               counts = processPending();
+               assert(counts.timer >= 1);
+               i = eval("set ::tm");
+               assert(i == 1);
+          }
+          
+          std::cout << "event processing test OK\n";
+          
+          {
+               int fds[2];
+               i = pipe(fds);
+               assert(i == 0);
+               
+               std::string received;
+               {
+                    FdHandle h(watchFd(fds[0], readable, [&](int events)
+                         {
+                              assert(events & readable);
+                              char buf[16];
+                              ssize_t n = read(fds[0], buf, sizeof(buf));
+                              if (n > 0) received.append(buf, n);
+                         }));
+                    
+                    processPending();
+                    assert(received.empty());
+                    
+                    i = static_cast<int>(write(fds[1], "data", 4));
+                    EventCounts counts = processEvents(1000, fileEvents);
+                    assert(counts.file == 1 && received == "data");
+               }
+               
+               // not watched anymore
+               i = static_cast<int>(write(fds[1], "more", 4));
+               EventCounts counts = processPending(fileEvents);
+               assert(counts.file == 0 && received == "data");
+               
+               close(fds[0]);
+               close(fds[1]);
+          }
+          
+          std::cout << "file descriptor test OK\n";
+          
+          {
+               FrameScheduler fs(50);
+               int redraws = 0;
+               for (int n = 0; n != 10; ++n)
+               {
+                    fs.request(".c", [&] { ++redraws; });
+               }
+               fs.request(".x", [&] { ++redraws; });
+               fs.cancel(".x");
+               
+               eval("after 100 {set ::frame 1}; vwait ::frame");
+               assert(redraws == 1 && fs.frames() == 1);
+               assert(fs.lastFrameTime() >= 0.0);
+               
+               fs.request(".c", [&] { ++redraws; });
+               fs.runFrame();
+               assert(redraws == 2 && fs.frames() == 2);
+               
+               // the idle handler that queues itself again
+               // runs once per frame
+               eval("set ::spins 0; proc spin {} "
+                    "{ incr ::spins; after idle spin }; after idle spin");
+               fs.runFrame();
+               int spins = eval("set ::spins");
+               assert(spins == 1);
+               eval("after cancel spin");
+          }
+          
+          std::cout << "frame scheduler test OK\n";
+          
+          {
+               int once = 0;
+               int periodic = 0;
+               long id = setTimeout(10, [&] { ++once; });
+               assert(timerActive(id));
+               
+               long cleared = setTimeout(10, [&] { ++once; });
+               clearTimer(cleared);
+               assert(!timerActive(cleared));
+               
+               long interval = 0;
+               interval = setInterval(5, [&]
+                    {
+                         if (++periodic == 3) clearTimer(interval);
+                    });
+               
+               {
+                    TimerHandle h(setTimeout(10, [&] { ++once; }));
+               }
+               
+               eval("after 200 {set ::timers 1}; vwait ::timers");
+               assert(once == 1 && periodic == 3);
+               assert(!timerActive(id) && !timerActive(interval));
+          }
+          
+          std::cout << "timers test OK\n";
+          
+          {
+               Widget b(button(".wb") -text("first"));
+               assert(b.path() == ".wb" && b.exists());
+               str = std::string(b.cget(text));
+               assert(str == "first");
+               b.configure() -text("second [x] $y");
+               str = std::string(b << cget(text));
+               assert(str == "second [x] $y");
+               destroy(b);
+               assert(!b.exists());
+          }
+          
+          std::cout << "widget handle test OK\n";
+
+          {
+               Tk::frame(".qc") -width(120) -height(80);
+               pack(".qc");
+               processPending();
+
+               enableQueryCache();
+               resetQueryCacheStats();
+               int w = winfo(width, ".qc");
+               w = winfo(width, ".qc");
+               assert(w == 120);
+               str = std::string(".qc" << cget(relief));
+               str = std::string(".qc" << cget(relief));
+               assert(str == "flat");
+               QueryCacheStats st = getQueryCacheStats();
+               assert(st.hits == 2 && st.misses == 2);
+
+               ".qc" << (configure() -width(150) -relief(raised));
+               str = std::string(".qc" << cget(relief));
+               assert(str == "raised");
+               processPending();
+               w = winfo(width, ".qc");
+               assert(w == 150);
+
+               // the widget is tagged once and untagged when disabled
+               str = std::string(eval("bindtags .qc"));
+               assert(str.find("CppTk::cache") == 0);
+               assert(str.find("CppTk::cache", 1) == std::string::npos);
+               enableQueryCache(false);
+               str = std::string(eval("bindtags .qc"));
+               assert(str.find("CppTk::cache") == std::string::npos);
+               destroy(".qc");
+          }
+
+          std::cout << "query cache test OK\n";
+          
+          {
+               enableShadowState();
+               button(".sh");
+               ".sh" << (configure() -background("red"));
+               ".sh" << (configure() -bg("blue"));
+               ".sh" << (configure() -background("red"));
+               str = std::string(".sh" << cget(background));
+               assert(str == "red");
+               
+               // the changes made by Tcl code are forgotten explicitly
+               eval("after idle {.sh configure -background green}");
+               processPending();
+               clearShadowState(".sh");
+               ".sh" << (configure() -background("red"));
+               str = std::string(".sh" << cget(background));
+               assert(str == "red");
+               
+               // and so is the widget destroyed by Tcl code
+               eval("destroy .sh; button .sh -background green");
+               ".sh" << (configure() -background("red"));
+               str = std::string(".sh" << cget(background));
+               assert(str == "red");
+               destroy(".sh");
+               enableShadowState(false);
+          }
+          
+          std::cout << "shadow state test OK\n";
+
+          {
+               std::size_t live = liveCallbacks();
+               for (int i = 0; i != 10; ++i)
+               {
+                    button(".cb") -command(pressed);
+                    bind(".cb", "<Enter>", pressed);
+                    assert(liveCallbacks() == live + 2);
+                    destroy(".cb");
+                    assert(liveCallbacks() == live);
+               }
+               
+               // the replaced callbacks are deleted at once
+               button(".cb");
+               for (int i = 0; i != 10; ++i)
+               {
+                    ".cb" << (configure() -command(pressed));
+                    bind(".cb", "<Enter>", pressed);
+               }
+               assert(liveCallbacks() == live + 2);
+               
+               // the appended binding keeps the previous callback
+               bind(".cb", "<Leave>", pressed);
+               std::string appended(details::addCallback(
+                    std::shared_ptr<details::CallbackBase>(
+                         new details::Callback0<void (*)()>(pressed))));
+               eval("bind .cb <Leave> {+" + appended + "}");
+               assert(liveCallbacks() == live + 4);
+               
+               // the callbacks of the failed command are deleted
+               bool failed = false;
+               try
+               {
+                    str = static_cast<std::string>(
+                         bind(".cb", "<NoSuchEvent>", pressed));
+               }
+               catch (TkError const &)
+               {
+                    failed = true;
+               }
+               assert(failed && liveCallbacks() == live + 4);
+               destroy(".cb");
+               assert(liveCallbacks() == live);
+          }
+
+          std::cout << "callback ownership test OK\n";
+          
+          {
+               enableCallbackDispatch();
+               int before = presses;
+               std::string first(callback(pressed));
+               deleteCallback(first);
+               std::string second(callback(countPress));
+               
+               // the stale name does not reach the callback in its slot
+               bool failed = false;
+               try
+               {
+                    str = static_cast<std::string>(eval(first));
+               }
+               catch (TkError const &)
+               {
+                    failed = true;
+               }
+               assert(failed && presses == before);
+               str = static_cast<std::string>(eval(second));
+               assert(presses == before + 1);
+               
+               // the missing arguments are reported with the usage
+               std::string message;
+               try
+               {
+                    str = static_cast<std::string>(eval("CppTk::dispatch 0"));
+               }
+               catch (TkError const &e)
+               {
+                    message = e.what();
+               }
+               assert(message.find("slot generation") != std::string::npos);
+               deleteCallback(second);
+               presses = before;
+               enableCallbackDispatch(false);
+          }
+          
+          std::cout << "callback dispatch test OK\n";
+
+          {
+               Result<bool> e = try_<bool>(winfo(exists, ".nosuch"));
+               assert(e.ok() && e.value() == false);
+               Result<std::string> r = try_(".nosuch" << cget(text));
+               assert(!r && r.errorCode() != "" && r.valueOr("none") == "none");
+               Result<int> w = try_<int>(winfo(width, "."));
+               assert(w.ok());
+               
+               // the expression evaluated before keeps its outcome
+               details::Expr failing(".nosuch" << cget(text));
+               assert(!try_(failing));
+               assert(!try_(failing));
+          }
+
+          std::cout << "try test OK\n";
+
+          {
+               enableProfiler();
+               {
+                    ProfileScope scope("profiled", 1);
+                    Tk::frame(".pf");
+                    destroy(".pf");
+               }
+               enableProfiler(false);
+               std::vector<ProfileEntry> p = getProfile();
+               assert(p.size() == 1 && p[0].file == "profiled");
+               assert(p[0].commands == 2 && p[0].slowestCommand != "");
+               assert(p[0].inclusive >= p[0].exclusive);
+               resetProfile();
+               assert(getProfile().empty());
+          }
+
+          std::cout << "profiler test OK\n";
+
+          {
+               startTrace();
+               assert(tracing());
+               {
+                    TraceSpan span("traced");
+                    eval("set traced 1");
+               }
+               stopTrace();
+               eval("set untraced 1");
+               
+               std::ostringstream ss;
+               writeTrace(ss);
+               str = ss.str();
+               assert(str.find("\"traceEvents\"") != std::string::npos);
+               assert(str.find("\"name\":\"traced\",\"cat\":\"app\"") !=
+                    std::string::npos);
+               assert(str.find("set traced 1") != std::string::npos);
+               assert(str.find("untraced") == std::string::npos);
+          }
+
+          std::cout << "trace test OK\n";
+
+          {
+               std::string fast(callback(pressed));
+               std::string slow(callback(blocking));
+               enableWatchdog(10, slowCall);
+               eval(fast);
+               eval(slow);
+               disableWatchdog();
+               eval(slow);
+               assert(slowCalls.size() == 1);
+               assert(slowCalls[0].kind == "callback");
+               assert(slowCalls[0].name == slow);
+               assert(slowCalls[0].duration >= 10);
+               deleteCallback(fast);
+               deleteCallback(slow);
+          }
+
+          std::cout << "watchdog test OK\n";
+
+          {
+               std::string cb(callback(pressed));
+               startCommandLog("cpptktest2.log");
+               Tk::frame(".lg");
+               ".lg" << (configure() -width(120));
+               eval("set logged {a  b}");
+               eval(cb);
+               stopCommandLog();
+               destroy(".lg");
+               eval("unset logged");
+               deleteCallback(cb);
+               
+               ReplayStats stats = replayCommandLog("cpptktest2.log");
+               assert(stats.commands == 3 && stats.errors == 0);
+               assert(stats.callbacks == 1);
+               int w = ".lg" << cget(width);
+               assert(w == 120);
+               str = std::string(eval("set logged"));
+               assert(str == "a  b");
+               destroy(".lg");
+               
+               // the original unknown is back after the replay
+               str = std::string(eval("info commands CppTk::unknown"));
+               assert(str.empty());
+               unlink("cpptktest2.log");
+          }
+
+          std::cout << "command log test OK\n";
+
+          {
+               Tk::frame(".ie");
+               bind(".ie", "<ButtonPress>", countPress);
+               startInputRecording();
+               eval("event generate .ie <ButtonPress> -button 1 -x 3 -y 4");
+               
+               // the binding that ends with break does not hide the event
+               eval("bind .ie <ButtonRelease> break");
+               eval("event generate .ie <ButtonRelease> -button 1");
+               std::vector<InputEvent> events = stopInputRecording();
+               assert(presses == 1);
+               assert(events.size() == 2 && events[0].widget == ".ie");
+               assert(events[0].button == 1 && events[0].x == 3);
+               assert(events[1].type == "ButtonRelease");
+               str = std::string(eval("bindtags .ie"));
+               assert(str.find("CppTk::input") == std::string::npos);
+               eval("bind .ie <ButtonRelease> {}");
+               events.pop_back();
+               
+               saveInputEvents("cpptktest2.input", events);
+               events = loadInputEvents("cpptktest2.input");
+               unlink("cpptktest2.input");
+               
+               InputReplayStats stats = replayInputEvents(events, 0);
+               assert(stats.events == 1 && stats.failed == 0);
+               assert(stats.latencies.size() == 1);
+               assert(presses == 2);
+               destroy(".ie");
+          }
+
+          std::cout << "input replay test OK\n";
+
+          {
+               CallbackHandle snap(callback("snap", countPress));
+               startSnapshot();
+               button(".sn") -command(snap) -text("snapshot");
+               pack(".sn");
+               std::string script = stopSnapshot();
+               destroy(".sn");
+               
+               saveSnapshot("cpptktest2.snap", script);
+               assert(loadSnapshot("cpptktest2.snap"));
+               assert(!loadSnapshot("cpptktest2.nosuch"));
+               unlink("cpptktest2.snap");
+               
+               str = std::string(".sn" << cget(text));
+               assert(str == "snapshot");
+               presses = 0;
+               ".sn" << invoke();
+               assert(presses == 1);
+               destroy(".sn");
+          }
+
+          std::cout << "snapshot test OK\n";
+
+          {
+               Tk::frame(".lz");
+               buildLazily(".lz", buildPanel);
+               assert(lazyPending(".lz"));
+               processPending();
+               int built = winfo(exists, ".lz.l");
+               assert(!built);
+               
+               // update waits for the window manager
+               pack(".lz");
+               update();
+               built = winfo(exists, ".lz.l");
+               assert(built && !lazyPending(".lz"));
+               destroy(".lz");
+               
+               Tk::frame(".lz");
+               buildLazily(".lz", buildPanel, true);
+               processPending(idleEvents);
+               built = winfo(exists, ".lz.l");
+               assert(built);
+               destroy(".lz");
+               
+               Tk::frame(".lz");
+               buildLazily(".lz", buildPanel);
+               assert(buildNow(".lz") && !buildNow(".lz"));
+               destroy(".lz");
+          }
+
+          std::cout << "lazy subtree test OK\n";
+
+          Tk::frame(".lb");
+          {
+               std::vector<std::string> labels;
+               for (int i = 0; i != 3; ++i)
+               {
+                    labels.push_back(".lb.l" + std::to_string(i));
+                    label(labels.back()) -text("field");
+               }
+               
+               LayoutBatch batch("grid", ".lb");
+               for (int i = 0; i != 3; ++i)
+               {
+                    batch.add(labels[i]) -row(i) -column(0) -sticky("e");
+               }
+               assert(batch.pending() == 3);
+               batch.commit();
+               assert(batch.pending() == 0);
+               std::vector<std::string> managed = grid(slaves, ".lb");
+               assert(managed.size() == 3);
+               int info = grid(propagate, ".lb");
+               assert(info == 1);
+               
+               // the propagation is restored also after errors
+               batch.add(".lb.nosuch") -row(3);
+               bool failed = false;
+               try
+               {
+                    batch.commit();
+               }
+               catch (TkError const &)
+               {
+                    failed = true;
+               }
+               info = grid(propagate, ".lb");
+               assert(failed && info == 1);
+               destroy(labels[0]);
+               
+               Tk::frame(".lp");
+               std::vector<Widget> items;
+               items.push_back(Widget(label(".lp.a")));
+               items.push_back(Widget(label(".lp.b")));
+               {
+                    LayoutBatch packBatch("pack", ".lp");
+                    packBatch.add(items.begin(), items.end()) -side(left);
+               }
+               managed = static_cast<std::vector<std::string> >(
+                    pack(slaves, ".lp"));
+               assert(managed.size() == 2);
+               destroy(".lp");
+               
+               failed = false;
+               try
+               {
+                    LayoutBatch wrong("table", ".lb");
+               }
+               catch (TkError const &)
+               {
+                    failed = true;
+               }
+               assert(failed);
+          }
+          destroy(".lb");
+
+          std::cout << "layout batch test OK\n";
+
+#if __cplusplus >= 202002L && defined(__cpp_impl_coroutine)
+          Tk::frame(".co");
+          {
+               std::vector<std::string> steps;
+               coroutineFlow(steps);
+               assert(steps.empty());
+               eval("after 50 {event generate .co <<Go>>}");
+               eval("vwait ::coroutine");
+               assert(steps.size() == 4 && steps[2] == ".co");
+               assert(steps[3] == "42");
+               str = std::string(eval("bindtags .co"));
+               assert(str.find("CppTk::wait") == std::string::npos);
+          }
+          
+          std::cout << "coroutines test OK\n";
+#endif
      }
      catch(std::exception const &e)
      {
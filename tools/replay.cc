@@ -0,0 +1,73 @@
+//
+// Copyright 2017 Declan Hoare
+//
+// Permission to copy, use, modify, sell and distribute this software
+// is granted provided this copyright notice appears in all copies.
+// This software is provided "as is" without express or implied
+// warranty, and with no claim as to its suitability for any purpose.
+//
+
+// replays the command log written by startCommandLog
+// usage: cpptk-replay [-realtime] [-wait] logfile
+
+#include "../cpptk.h"
+#include <cstring>
+#include <iostream>
+
+using namespace Tk;
+using namespace std;
+
+int main(int argc, char *argv[])
+{
+     bool realTime = false;
+     bool wait = false;
+     char const *fileName = 0;
+     for (int i = 1; i != argc; ++i)
+     {
+          if (strcmp(argv[i], "-realtime") == 0)
+          {
+               realTime = true;
+          }
+          else if (strcmp(argv[i], "-wait") == 0)
+          {
+               wait = true;
+          }
+          else if (fileName == 0)
+          {
+               fileName = argv[i];
+          }
+          else
+          {
+               fileName = 0;
+               break;
+          }
+     }
+     
+     if (fileName == 0)
+     {
+          cerr << "usage: " << argv[0] << " [-realtime] [-wait] logfile\n"
+               << "  -realtime  keep the recorded pace\n"
+               << "  -wait      run the event loop after the replay\n";
+          return 2;
+     }
+     
+     try
+     {
+          init(argv[0]);
+          
+          ReplayStats stats = replayCommandLog(fileName, realTime);
+          cout << stats.commands << " commands (" << stats.errors
+               << " failed), " << stats.callbacks << " callbacks in "
+               << stats.duration << " ms\n";
+          
+          if (wait)
+          {
+               runEventLoop();
+          }
+     }
+     catch (exception const &e)
+     {
+          cerr << "Error: " << e.what() << '\n';
+          return 1;
+     }
+}